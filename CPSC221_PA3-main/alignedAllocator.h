@@ -0,0 +1,70 @@
+/**
+ * @file alignedAllocator.h
+ * Minimal std::allocator replacement that hands out storage aligned to
+ * a fixed boundary (a cache line by default), so tables of small
+ * fixed-size cells never have a cell straddling two lines. The storage
+ * comes from the global operator new, so allocCounter counts it too.
+ */
+
+#ifndef _ALIGNEDALLOCATOR_H_
+#define _ALIGNEDALLOCATOR_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+
+template <class T, std::size_t Align = 64>
+class alignedAllocator {
+    static_assert(Align >= sizeof(void *) && (Align & (Align - 1)) == 0,
+                  "Align must be a power of two that holds a pointer");
+
+public:
+    typedef T value_type;
+
+    template <class U>
+    struct rebind {
+        typedef alignedAllocator<U, Align> other;
+    };
+
+    alignedAllocator() {}
+
+    template <class U>
+    alignedAllocator(const alignedAllocator<U, Align> &) {}
+
+    T *allocate(std::size_t n) {
+        if (n == 0) {
+            return NULL;
+        }
+        if (n > (SIZE_MAX - Align) / sizeof(T)) {
+            throw std::bad_alloc();
+        }
+        // Align spare bytes hold the block's start just below the
+        // aligned pointer, so deallocate can find it
+        char *block =
+            static_cast<char *>(::operator new(n * sizeof(T) + Align));
+        std::uintptr_t start = reinterpret_cast<std::uintptr_t>(block);
+        char *p = block + (Align - start % Align);
+        reinterpret_cast<void **>(p)[-1] = block;
+        return reinterpret_cast<T *>(p);
+    }
+
+    void deallocate(T *p, std::size_t) {
+        if (p != NULL) {
+            ::operator delete(reinterpret_cast<void **>(p)[-1]);
+        }
+    }
+};
+
+template <class T, class U, std::size_t Align>
+bool operator==(const alignedAllocator<T, Align> &,
+                const alignedAllocator<U, Align> &) {
+    return true;
+}
+
+template <class T, class U, std::size_t Align>
+bool operator!=(const alignedAllocator<T, Align> &,
+                const alignedAllocator<U, Align> &) {
+    return false;
+}
+
+#endif
@@ -0,0 +1,66 @@
+#include "allocCounter.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+using namespace std;
+
+namespace {
+
+atomic<long> allocations(0);
+
+void *countedAlloc(size_t size) {
+    allocations.fetch_add(1, memory_order_relaxed);
+    void *p = malloc(size > 0 ? size : 1);
+    if (p == NULL) {
+        throw bad_alloc();
+    }
+    return p;
+}
+
+} // namespace
+
+long allocationCount() {
+    return allocations.load(memory_order_relaxed);
+}
+
+void *operator new(size_t size) {
+    return countedAlloc(size);
+}
+
+void *operator new[](size_t size) {
+    return countedAlloc(size);
+}
+
+void *operator new(size_t size, const nothrow_t &) noexcept {
+    try {
+        return countedAlloc(size);
+    } catch (const bad_alloc &) {
+        return NULL;
+    }
+}
+
+void *operator new[](size_t size, const nothrow_t &) noexcept {
+    try {
+        return countedAlloc(size);
+    } catch (const bad_alloc &) {
+        return NULL;
+    }
+}
+
+void operator delete(void *p) noexcept {
+    free(p);
+}
+
+void operator delete[](void *p) noexcept {
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+    free(p);
+}
+
+void operator delete[](void *p, size_t) noexcept {
+    free(p);
+}
@@ -0,0 +1,18 @@
+/**
+ * @file allocCounter.h
+ * Opt-in count of heap allocations. Linking allocCounter.o into a program
+ * replaces the global operator new with one that counts its calls; the
+ * test and benchmark builds do so to check that the stats queries never
+ * touch the heap. pa3 itself is built without it.
+ */
+
+#ifndef _ALLOCCOUNTER_H_
+#define _ALLOCCOUNTER_H_
+
+/**
+ * Returns the number of calls to any form of operator new so far, from
+ * every thread.
+ */
+long allocationCount();
+
+#endif
@@ -0,0 +1,246 @@
+// File:        benchmark.cpp
+// Description: Micro-benchmarks for the hot paths of stats and twoDtree.
+//              Build with optimizations for meaningful numbers:
+//                  make OPT=-O2 pa3bench
+//              Usage: ./pa3bench [image.png]
+
+#include "allocCounter.h"
+#include "cs221util/HSLAPixel.h"
+#include "cs221util/PNG.h"
+#include "entropyKernel.h"
+#include "stats.h"
+#include "twoDtree.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+using namespace cs221util;
+using namespace std;
+
+typedef chrono::steady_clock benchClock;
+
+static double secondsSince(benchClock::time_point start) {
+    return chrono::duration<double>(benchClock::now() - start).count();
+}
+
+/**
+ * Random rectangles inside a w x h image, from a fixed seed so every run
+ * (and every kernel) answers the same queries.
+ */
+static vector<pair<pair<int, int>, pair<int, int>>> randomRects(int w, int h,
+                                                                int n) {
+    mt19937 gen(221);
+    vector<pair<pair<int, int>, pair<int, int>>> rects(n);
+    for (int i = 0; i < n; i++) {
+        int xa = gen() % w, xb = gen() % w;
+        int ya = gen() % h, yb = gen() % h;
+        rects[i].first = make_pair(min(xa, xb), min(ya, yb));
+        rects[i].second = make_pair(max(xa, xb), max(ya, yb));
+    }
+    return rects;
+}
+
+static void benchEntropy(stats &s, int w, int h) {
+    const int queries = 1000000;
+    vector<pair<pair<int, int>, pair<int, int>>> rects =
+        randomRects(w, h, queries);
+
+    printf("entropy queries (%d random rectangles)\n", queries);
+    for (int level = SIMD_SCALAR; level <= detectSimdLevel(); level++) {
+        setSimdLevel((simdLevel)level);
+        double checksum = 0.0;
+        long allocs = allocationCount();
+        benchClock::time_point start = benchClock::now();
+        for (int i = 0; i < queries; i++) {
+            checksum += s.entropy(rects[i].first, rects[i].second);
+        }
+        double secs = secondsSince(start);
+        allocs = allocationCount() - allocs;
+        printf("  %-8s %12.0f queries/s   checksum %.17g   %ld allocs\n",
+               simdLevelName((simdLevel)level), queries / secs, checksum,
+               allocs);
+    }
+    setSimdLevel(detectSimdLevel());
+}
+
+static void benchBuild(PNG &im) {
+    const char *names[] = {"scan", "sweep", "coarse", "bound"};
+    splitSearch modes[] = {SEARCH_SCAN, SEARCH_SWEEP, SEARCH_COARSE,
+                           SEARCH_BOUND};
+
+    printf("twoDtree construction\n");
+    for (int i = 0; i < 4; i++) {
+        buildOptions opts;
+        opts.search = modes[i];
+        benchClock::time_point start = benchClock::now();
+        long allocs = allocationCount();
+        twoDtree t(im, opts);
+        printf("  %-8s %8.3f s   %ld allocs\n", names[i], secondsSince(start),
+               allocationCount() - allocs);
+    }
+    buildOptions audited;
+    audited.search = SEARCH_COARSE;
+    searchAudit audit;
+    audited.audit = &audit;
+    twoDtree checked(im, audited);
+    printf("  coarse   %ld/%ld searches differ, %.1f%% of the evaluations, "
+           "excess cost %.3g\n",
+           audit.mismatches, audit.searches,
+           100.0 * audit.evaluated / audit.exhaustive, audit.excess);
+    searchAudit skips;
+    audited.search = SEARCH_BOUND;
+    audited.audit = &skips;
+    twoDtree bounded(im, audited);
+    printf("  bound    %ld/%ld searches differ, %ld of %ld lines skipped\n",
+           skips.mismatches, skips.searches, skips.exhaustive - skips.evaluated,
+           skips.exhaustive);
+    benchClock::time_point start = benchClock::now();
+    twoDtree copied(checked);
+    printf("  copy     %8.3f s\n", secondsSince(start));
+    start = benchClock::now();
+    packedTree packed = checked.pack();
+    printf("  pack     %8.3f s   %zu nodes\n", secondsSince(start),
+           packed.size());
+    start = benchClock::now();
+    copied.prune(.05);
+    printf("  prune    %8.3f s\n", secondsSince(start));
+    start = benchClock::now();
+    size_t leaves = checked.leafCount(.05);
+    printf("  annotate %8.3f s   %zu leaves at .05\n", secondsSince(start),
+           leaves);
+    start = benchClock::now();
+    checked.render(.05);
+    printf("  render .05 %6.3f s\n", secondsSince(start));
+    start = benchClock::now();
+    buildOptions tol;
+    tol.tol = .05;
+    twoDtree pruned(im, tol);
+    printf("  tol .05  %8.3f s   %zu nodes\n", secondsSince(start),
+           pruned.pack().size());
+    start = benchClock::now();
+    long allocs = allocationCount();
+    buildOptions budget;
+    budget.maxLeaves = 4096;
+    twoDtree best(im, budget);
+    printf("  4096 leaves %5.3f s   %ld allocs\n", secondsSince(start),
+           allocationCount() - allocs);
+    start = benchClock::now();
+    twoDtree variance(im, buildOptions(), varianceCost());
+    printf("  variance %8.3f s\n", secondsSince(start));
+    int threads[] = {1, 2, 4, 0};
+    for (int n : threads) {
+        buildOptions opts;
+        opts.threads = n;
+        start = benchClock::now();
+        twoDtree t(im, opts);
+        printf("  %2d threads %6.3f s\n", resolveThreads(n),
+               secondsSince(start));
+    }
+    histBins bins[] = {BINS_16, BINS_36, BINS_72};
+    for (histBins b : bins) {
+        buildOptions opts;
+        opts.bins = b;
+        benchClock::time_point start = benchClock::now();
+        twoDtree t(im, opts);
+        printf("  %2d bins  %8.3f s\n", (int)b, secondsSince(start));
+    }
+}
+
+/**
+ * A color at the point x, y, z of the cone HSLAPixel::dist measures in.
+ */
+static HSLAPixel conePixel(double x, double y, double z) {
+    double h = atan2(x, y) * 180 / PI;
+    return HSLAPixel(h < 0 ? h + 360 : h, sqrt(x * x + y * y) / z, z, 1.0);
+}
+
+/**
+ * Prunes trees of growing images whose colors keep many bounds of
+ * toPrune open: pixels lie a step from a common color along one axis of
+ * the cone each, so every pixel is within tol but the box of any two
+ * different ones is not, and every 97th pixel is a step off along all
+ * three axes, which no single axis rules out. The time per node shows
+ * how the prune grows with the tree, from the color bounds and from the
+ * farthest leaves leafCount finds.
+ */
+static void benchPrune() {
+    const double step = .06, tol = .005;
+    printf("prune, undecided bounds (tol %g)\n", tol);
+    for (int n = 128; n <= 1024; n *= 2) {
+        PNG im(n, n);
+        for (int y = 0; y < n; y++) {
+            for (int x = 0; x < n; x++) {
+                double v[3] = {0, .25, .5};
+                int k = (x + 2 * y) % 6;
+                v[k / 2] += (k % 2) ? -step : step;
+                if ((x * 7 + y * 13) % 97 == 0) {
+                    for (int i = 0; i < 3; i++) {
+                        v[i] += .05;
+                    }
+                }
+                *im.getPixel(x, y) = conePixel(v[0], v[1], v[2]);
+            }
+        }
+        twoDtree full(im);
+        double nodes = full.pack().size();
+        twoDtree bounded(full);
+        benchClock::time_point start = benchClock::now();
+        bounded.prune(tol);
+        double boundSecs = secondsSince(start);
+        twoDtree annotated(full);
+        start = benchClock::now();
+        annotated.leafCount(tol);
+        double annotateSecs = secondsSince(start);
+        start = benchClock::now();
+        annotated.prune(tol);
+        double limitSecs = secondsSince(start);
+        printf("  %4d^2 %8.0f nodes   bounds %6.1f ns/node   leafCount %6.1f"
+               " ns/node   then prune %5.1f ns/node\n",
+               n, nodes, 1e9 * boundSecs / nodes, 1e9 * annotateSecs / nodes,
+               1e9 * limitSecs / nodes);
+    }
+}
+
+int main(int argc, char **argv) {
+    const char *file = (argc > 1) ? argv[1] : "images/canadaPlace.png";
+    PNG im;
+    if (!im.readFromFile(file)) {
+        return 1;
+    }
+    printf("%s: %u x %u\n", file, im.width(), im.height());
+
+    printf("stats construction\n");
+    for (int threads = 1; threads <= resolveThreads(0); threads *= 2) {
+        benchClock::time_point start = benchClock::now();
+        stats s(im, threads);
+        printf("  %2d threads %8.3f s\n", threads, secondsSince(start));
+    }
+    const char *modeNames[] = {"double", "fixed64", "quant8"};
+    for (int mode = SAT_DOUBLE; mode <= SAT_QUANT8; mode++) {
+        benchClock::time_point start = benchClock::now();
+        stats s(im, 0, (satMode)mode);
+        printf("  %-10s %8.3f s\n", modeNames[mode], secondsSince(start));
+    }
+    stats s(im);
+
+    const char *cacheFile = "pa3bench-stats.bin";
+    benchClock::time_point start = benchClock::now();
+    imageKey key(im);
+    printf("  image key   %7.3f s\n", secondsSince(start));
+    start = benchClock::now();
+    s.writeToFile(cacheFile, key);
+    printf("  cache write %7.3f s\n", secondsSince(start));
+    start = benchClock::now();
+    stats cached;
+    cached.readFromFile(cacheFile, key);
+    printf("  cache open  %7.3f s\n", secondsSince(start));
+    remove(cacheFile);
+
+    benchEntropy(s, im.width(), im.height());
+    benchBuild(im);
+    benchPrune();
+    return 0;
+}
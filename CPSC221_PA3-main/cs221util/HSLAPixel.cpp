@@ -38,14 +38,6 @@ HSLAPixel::HSLAPixel(double hue, double saturation, double luminance,
     a = alpha;
 }
 
-HSLAPixel &HSLAPixel::operator=(HSLAPixel const &other) {
-    this->h = other.h;
-    this->s = other.s;
-    this->l = other.l;
-    this->a = other.a;
-    return *this;
-}
-
 bool HSLAPixel::operator==(HSLAPixel const &other) const {
 
     return dist(other) < 0.007;
@@ -49,7 +49,7 @@ public:
      */
     HSLAPixel(double hue, double saturation, double luminance, double alpha);
 
-    HSLAPixel &operator=(HSLAPixel const &other);
+    HSLAPixel &operator=(HSLAPixel const &other) = default;
     bool operator==(HSLAPixel const &other) const;
     bool operator!=(HSLAPixel const &other) const;
     bool operator<(HSLAPixel const &other) const;
@@ -13,6 +13,7 @@
 
 #include <algorithm>
 #include <cassert>
+#include <cstdint>
 #include <functional>
 #include <iostream>
 #include <string>
@@ -48,6 +49,14 @@ PNG::PNG(PNG const &other) {
     _copy(other);
 }
 
+PNG::PNG(PNG &&other) noexcept
+    : width_(other.width_), height_(other.height_),
+      imageData_(other.imageData_) {
+    other.width_ = 0;
+    other.height_ = 0;
+    other.imageData_ = NULL;
+}
+
 PNG::~PNG() {
     delete[] imageData_;
 }
@@ -59,6 +68,19 @@ PNG const &PNG::operator=(PNG const &other) {
     return *this;
 }
 
+PNG const &PNG::operator=(PNG &&other) noexcept {
+    if (this != &other) {
+        delete[] imageData_;
+        width_ = other.width_;
+        height_ = other.height_;
+        imageData_ = other.imageData_;
+        other.width_ = 0;
+        other.height_ = 0;
+        other.imageData_ = NULL;
+    }
+    return *this;
+}
+
 bool PNG::operator==(PNG const &other) const {
     if (width_ != other.width_) {
         return false;
@@ -208,21 +230,55 @@ void PNG::resize(unsigned int newWidth, unsigned int newHeight) {
     imageData_ = newImageData;
 }
 
+/**
+ * Returns b to the power e, modulo 2^64.
+ */
+static uint64_t powMod64(uint64_t b, uint64_t e) {
+    uint64_t r = 1;
+    for (; e > 0; e >>= 1) {
+        if (e & 1) {
+            r *= b;
+        }
+        b *= b;
+    }
+    return r;
+}
+
 std::size_t PNG::computeHash() const {
+    // The hash folds the channels of the pixels, in column-major order,
+    // into hash = 3 * hash + f(channel). Unrolled, it is the sum over all
+    // channel values c_i of f(c_i) * 3^(n-1-i), so the pixels can be
+    // visited in memory (row-major) order instead, each pixel's term
+    // weighted by its column-major position. Stepping one column right
+    // moves 4*height channels further along, which divides the weight by
+    // 3^(4*height); 3 is odd, so it has an inverse modulo 2^64. The sums
+    // wrap like the original recurrence, so the result is the same.
     std::hash<float> hashFunction;
-    std::size_t hash = 0;
-
-    for (unsigned x = 0; x < this->width(); x++) {
-        for (unsigned y = 0; y < this->height(); y++) {
-            HSLAPixel *pixel = this->getPixel(x, y);
-            hash = (hash << 1) + hash + hashFunction(pixel->h);
-            hash = (hash << 1) + hash + hashFunction(pixel->s);
-            hash = (hash << 1) + hash + hashFunction(pixel->l);
-            hash = (hash << 1) + hash + hashFunction(pixel->a);
+    uint64_t n = (uint64_t)width_ * height_;
+    if (n == 0) {
+        return 0;
+    }
+    const uint64_t inverse3 = 0xaaaaaaaaaaaaaaabULL; // 3 * inverse3 == 1
+    uint64_t columnStep = powMod64(inverse3, 4 * (uint64_t)height_);
+    uint64_t rowStep = powMod64(inverse3, 4);
+    uint64_t rowWeight = powMod64(3, 4 * (n - 1)); // pixel (0,0)
+    uint64_t hash = 0;
+
+    for (unsigned y = 0; y < height_; y++) {
+        const HSLAPixel *row = imageData_ + (size_t)y * width_;
+        uint64_t weight = rowWeight;
+        for (unsigned x = 0; x < width_; x++) {
+            uint64_t term = hashFunction(row[x].h);
+            term = 3 * term + hashFunction(row[x].s);
+            term = 3 * term + hashFunction(row[x].l);
+            term = 3 * term + hashFunction(row[x].a);
+            hash += term * weight;
+            weight *= columnStep;
         }
+        rowWeight *= rowStep;
     }
 
-    return hash;
+    return (std::size_t)hash;
 }
 
 std::ostream &operator<<(std::ostream &os, PNG const &png) {
@@ -37,6 +37,13 @@ public:
      */
     PNG(PNG const &other);
 
+    /**
+     * Move constructor: takes over the pixels of another image, which
+     * is left empty (0x0).
+     * @param other PNG to be moved from.
+     */
+    PNG(PNG &&other) noexcept;
+
     /**
      * Destructor: frees all memory associated with a given PNG object.
      * Invoked by the system.
@@ -50,6 +57,14 @@ public:
      */
     PNG const &operator=(PNG const &other);
 
+    /**
+     * Move assignment operator: frees the current image and takes over
+     * the pixels of other, which is left empty (0x0).
+     * @param other Image to move into the current image.
+     * @return The current image for assignment chaining.
+     */
+    PNG const &operator=(PNG &&other) noexcept;
+
     /**
      * Equality operator: checks if two images are the same.
      * @param other Image to be checked.
@@ -0,0 +1,478 @@
+#include "entropyKernel.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define ENTROPY_X86 1
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+// every loop over the bins has a trip count fixed by BINS; unroll it
+#define UNROLL_BINS _Pragma("GCC unroll 72")
+
+namespace {
+
+/**
+ * Whether the 32-bit parts of the rectangle corners c cancel out, as
+ * they do when all four corners lie in the same super tile row and
+ * column (c[0] and c[1] share their column, c[0] and c[2] their row).
+ */
+inline bool superCancels(const histCorner *c) {
+    return c[0].above == c[1].above && c[2].above == c[3].above &&
+           c[0].left == c[2].left && c[1].left == c[3].left;
+}
+
+/**
+ * Number of pixels of bin k at corner c, from its 32-bit parts alone.
+ */
+inline int32_t superCount(const histCorner &c, int k) {
+    return (int32_t)(c.above[k] + c.left[k]);
+}
+
+/**
+ * Number of pixels of bin k at corner c, from its tile-relative parts.
+ */
+inline int32_t tileCount(const histCorner &c, int k) {
+    return c.row[k] + c.col[k] + c.local[k];
+}
+
+template <int BINS>
+void combineScalar(const histCorner *c, int32_t *counts) {
+    UNROLL_BINS
+    for (int k = 0; k < BINS; k++) {
+        counts[k] = tileCount(c[0], k) - tileCount(c[1], k) -
+                    tileCount(c[2], k) + tileCount(c[3], k);
+    }
+    if (superCancels(c)) {
+        return;
+    }
+    UNROLL_BINS
+    for (int k = 0; k < BINS; k++) {
+        counts[k] += superCount(c[0], k) - superCount(c[1], k) -
+                     superCount(c[2], k) + superCount(c[3], k);
+    }
+}
+
+/**
+ * Adds a[k] - b[k] to counts[k] for every bin, for a 32-bit part of two
+ * corners.
+ */
+template <int BINS>
+void addDiffScalar(const uint32_t *a, const uint32_t *b, int32_t *counts) {
+    UNROLL_BINS
+    for (int k = 0; k < BINS; k++) {
+        counts[k] += (int32_t)(a[k] - b[k]);
+    }
+}
+
+template <int BINS>
+void diffScalar(const histCorner &a, const histCorner &b, int32_t *counts) {
+    UNROLL_BINS
+    for (int k = 0; k < BINS; k++) {
+        counts[k] = tileCount(a, k) - tileCount(b, k);
+    }
+    // corners on a line within a super tile share one of the parts
+    if (a.above != b.above) {
+        addDiffScalar<BINS>(a.above, b.above, counts);
+    }
+    if (a.left != b.left) {
+        addDiffScalar<BINS>(a.left, b.left, counts);
+    }
+}
+
+/**
+ * Turns the lane sums of c log2(c) into the entropy of area pixels.
+ */
+inline double finishEntropy(double lanes02, double lanes13, long area,
+                            const nlognTable &t) {
+    return (t(area) - (lanes02 + lanes13)) / (double)area;
+}
+
+template <int BINS>
+double countEntropyScalar(const int32_t *counts, long area,
+                          const nlognTable &t) {
+    double acc[4] = {0.0, 0.0, 0.0, 0.0};
+    UNROLL_BINS
+    for (int k = 0; k < BINS; k++) {
+        acc[k % 4] += t(counts[k]);
+    }
+    return finishEntropy(acc[0] + acc[2], acc[1] + acc[3], area, t);
+}
+
+template <int BINS>
+double cornerEntropyScalar(const histCorner *c, long area,
+                           const nlognTable &t) {
+    alignas(32) int32_t counts[BINS];
+    combineScalar<BINS>(c, counts);
+    return countEntropyScalar<BINS>(counts, area, t);
+}
+
+#ifdef ENTROPY_X86
+
+/**
+ * Table lookups for four counts, for kernels without a gather.
+ */
+inline void lanesNlogn(const int32_t *c, const nlognTable &t, double *out) {
+    for (int l = 0; l < 4; l++) {
+        out[l] = t(c[l]);
+    }
+}
+
+/* ---- SSE2 ------------------------------------------------------------ */
+
+/**
+ * The tile-relative parts of bins k..k+3 at c, summed as 16-bit lanes
+ * and widened to 32.
+ */
+inline __m128i tileCount4(const histCorner &c, int k) {
+    int32_t v;
+    memcpy(&v, c.local + k, sizeof(v));
+    __m128i zero = _mm_setzero_si128();
+    __m128i local = _mm_unpacklo_epi8(_mm_cvtsi32_si128(v), zero);
+    __m128i row = _mm_loadl_epi64((const __m128i *)(c.row + k));
+    __m128i col = _mm_loadl_epi64((const __m128i *)(c.col + k));
+    __m128i sum = _mm_add_epi16(_mm_add_epi16(row, col), local);
+    return _mm_unpacklo_epi16(sum, zero);
+}
+
+inline __m128i superCount4(const histCorner &c, int k) {
+    __m128i above = _mm_loadu_si128((const __m128i *)(c.above + k));
+    __m128i left = _mm_loadu_si128((const __m128i *)(c.left + k));
+    return _mm_add_epi32(above, left);
+}
+
+template <int BINS>
+void combineSse2(const histCorner *c, int32_t *counts) {
+    UNROLL_BINS
+    for (int k = 0; k < BINS; k += 4) {
+        __m128i v = _mm_sub_epi32(tileCount4(c[0], k), tileCount4(c[1], k));
+        v = _mm_add_epi32(_mm_sub_epi32(v, tileCount4(c[2], k)),
+                          tileCount4(c[3], k));
+        _mm_store_si128((__m128i *)(counts + k), v);
+    }
+    if (superCancels(c)) {
+        return;
+    }
+    UNROLL_BINS
+    for (int k = 0; k < BINS; k += 4) {
+        __m128i v = _mm_sub_epi32(superCount4(c[0], k), superCount4(c[1], k));
+        v = _mm_add_epi32(_mm_sub_epi32(v, superCount4(c[2], k)),
+                          superCount4(c[3], k));
+        __m128i *out = (__m128i *)(counts + k);
+        _mm_store_si128(out, _mm_add_epi32(_mm_load_si128(out), v));
+    }
+}
+
+template <int BINS>
+void addDiffSse2(const uint32_t *a, const uint32_t *b, int32_t *counts) {
+    UNROLL_BINS
+    for (int k = 0; k < BINS; k += 4) {
+        __m128i v = _mm_sub_epi32(_mm_loadu_si128((const __m128i *)(a + k)),
+                                  _mm_loadu_si128((const __m128i *)(b + k)));
+        __m128i *out = (__m128i *)(counts + k);
+        _mm_store_si128(out, _mm_add_epi32(_mm_load_si128(out), v));
+    }
+}
+
+template <int BINS>
+void diffSse2(const histCorner &a, const histCorner &b, int32_t *counts) {
+    UNROLL_BINS
+    for (int k = 0; k < BINS; k += 4) {
+        _mm_store_si128((__m128i *)(counts + k),
+                        _mm_sub_epi32(tileCount4(a, k), tileCount4(b, k)));
+    }
+    if (a.above != b.above) {
+        addDiffSse2<BINS>(a.above, b.above, counts);
+    }
+    if (a.left != b.left) {
+        addDiffSse2<BINS>(a.left, b.left, counts);
+    }
+}
+
+template <int BINS>
+double countEntropySse2(const int32_t *counts, long area,
+                        const nlognTable &t) {
+    __m128d accLo = _mm_setzero_pd(); // lanes 0, 1
+    __m128d accHi = _mm_setzero_pd(); // lanes 2, 3
+    alignas(16) double v[4];
+    UNROLL_BINS
+    for (int k = 0; k < BINS; k += 4) {
+        lanesNlogn(counts + k, t, v);
+        accLo = _mm_add_pd(accLo, _mm_load_pd(v));
+        accHi = _mm_add_pd(accHi, _mm_load_pd(v + 2));
+    }
+    __m128d s = _mm_add_pd(accLo, accHi);
+    return finishEntropy(_mm_cvtsd_f64(s), _mm_cvtsd_f64(_mm_unpackhi_pd(s, s)),
+                         area, t);
+}
+
+template <int BINS>
+double cornerEntropySse2(const histCorner *c, long area,
+                         const nlognTable &t) {
+    alignas(32) int32_t counts[BINS];
+    combineSse2<BINS>(c, counts);
+    return countEntropySse2<BINS>(counts, area, t);
+}
+
+/* ---- AVX2 ------------------------------------------------------------ */
+
+__attribute__((target("avx2"))) inline __m256i
+superCount8(const histCorner &c, int k) {
+    __m256i above = _mm256_loadu_si256((const __m256i *)(c.above + k));
+    __m256i left = _mm256_loadu_si256((const __m256i *)(c.left + k));
+    return _mm256_add_epi32(above, left);
+}
+
+__attribute__((target("avx2"))) inline __m256i
+tileCount8(const histCorner &c, int k) {
+    __m128i row = _mm_loadu_si128((const __m128i *)(c.row + k));
+    __m128i col = _mm_loadu_si128((const __m128i *)(c.col + k));
+    __m128i local =
+        _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)(c.local + k)));
+    __m128i tile = _mm_add_epi16(_mm_add_epi16(row, col), local);
+    return _mm256_cvtepu16_epi32(tile);
+}
+
+/**
+ * Adds c log2(c) for the four counts in c into acc, gathering from the
+ * table unless a count falls beyond it.
+ */
+__attribute__((target("avx2"))) inline __m256d
+accumulate4(__m256d acc, __m128i c, const nlognTable &t) {
+    __m128i inTable = _mm_cmplt_epi32(c, _mm_set1_epi32(t.size()));
+    if (_mm_movemask_ps(_mm_castsi128_ps(inTable)) == 0xf) {
+        __m256d all = _mm256_castsi256_pd(_mm256_set1_epi64x(-1));
+        __m256d v = _mm256_mask_i32gather_pd(_mm256_setzero_pd(), t.data(),
+                                             c, all, 8);
+        return _mm256_add_pd(acc, v);
+    }
+    alignas(16) int32_t counts[4];
+    alignas(32) double v[4];
+    _mm_store_si128((__m128i *)counts, c);
+    lanesNlogn(counts, t, v);
+    return _mm256_add_pd(acc, _mm256_load_pd(v));
+}
+
+__attribute__((target("avx2"))) inline double
+finishAvx2(__m256d acc, long area, const nlognTable &t) {
+    __m128d s = _mm_add_pd(_mm256_castpd256_pd128(acc),
+                           _mm256_extractf128_pd(acc, 1));
+    return finishEntropy(_mm_cvtsd_f64(s), _mm_cvtsd_f64(_mm_unpackhi_pd(s, s)),
+                         area, t);
+}
+
+template <int BINS>
+__attribute__((target("avx2"))) void
+addDiffAvx2(const uint32_t *a, const uint32_t *b, int32_t *counts) {
+    for (int k = 0; k + 8 <= BINS; k += 8) {
+        __m256i v =
+            _mm256_sub_epi32(_mm256_loadu_si256((const __m256i *)(a + k)),
+                             _mm256_loadu_si256((const __m256i *)(b + k)));
+        __m256i *out = (__m256i *)(counts + k);
+        _mm256_storeu_si256(out, _mm256_add_epi32(_mm256_loadu_si256(out), v));
+    }
+    if (BINS % 8 != 0) {
+        int k = BINS - 4;
+        __m128i v = _mm_sub_epi32(_mm_loadu_si128((const __m128i *)(a + k)),
+                                  _mm_loadu_si128((const __m128i *)(b + k)));
+        __m128i *out = (__m128i *)(counts + k);
+        _mm_store_si128(out, _mm_add_epi32(_mm_load_si128(out), v));
+    }
+}
+
+template <int BINS>
+__attribute__((target("avx2"))) void
+diffAvx2(const histCorner &a, const histCorner &b, int32_t *counts) {
+    for (int k = 0; k + 8 <= BINS; k += 8) {
+        _mm256_storeu_si256(
+            (__m256i *)(counts + k),
+            _mm256_sub_epi32(tileCount8(a, k), tileCount8(b, k)));
+    }
+    if (BINS % 8 != 0) {
+        int k = BINS - 4;
+        __m128i tail = _mm_sub_epi32(tileCount4(a, k), tileCount4(b, k));
+        _mm_store_si128((__m128i *)(counts + k), tail);
+    }
+    if (a.above != b.above) {
+        addDiffAvx2<BINS>(a.above, b.above, counts);
+    }
+    if (a.left != b.left) {
+        addDiffAvx2<BINS>(a.left, b.left, counts);
+    }
+}
+
+template <int BINS>
+__attribute__((target("avx2"))) double
+countEntropyAvx2(const int32_t *counts, long area, const nlognTable &t) {
+    __m256d acc = _mm256_setzero_pd();
+    for (int k = 0; k < BINS; k += 4) {
+        acc = accumulate4(acc, _mm_load_si128((const __m128i *)(counts + k)),
+                          t);
+    }
+    return finishAvx2(acc, area, t);
+}
+
+template <int BINS>
+__attribute__((target("avx2"))) double
+cornerEntropyAvx2(const histCorner *c, long area, const nlognTable &t) {
+    bool cancels = superCancels(c);
+    __m256d acc = _mm256_setzero_pd();
+    for (int k = 0; k + 8 <= BINS; k += 8) {
+        __m256i v = _mm256_sub_epi32(tileCount8(c[0], k), tileCount8(c[1], k));
+        v = _mm256_add_epi32(_mm256_sub_epi32(v, tileCount8(c[2], k)),
+                             tileCount8(c[3], k));
+        if (!cancels) {
+            __m256i s = _mm256_sub_epi32(superCount8(c[0], k),
+                                         superCount8(c[1], k));
+            s = _mm256_add_epi32(_mm256_sub_epi32(s, superCount8(c[2], k)),
+                                 superCount8(c[3], k));
+            v = _mm256_add_epi32(v, s);
+        }
+        acc = accumulate4(acc, _mm256_castsi256_si128(v), t);
+        acc = accumulate4(acc, _mm256_extracti128_si256(v, 1), t);
+    }
+    if (BINS % 8 != 0) {
+        // the last four bins
+        int k = BINS - 4;
+        __m128i v = _mm_sub_epi32(tileCount4(c[0], k), tileCount4(c[1], k));
+        v = _mm_add_epi32(_mm_sub_epi32(v, tileCount4(c[2], k)),
+                          tileCount4(c[3], k));
+        if (!cancels) {
+            __m128i s =
+                _mm_sub_epi32(superCount4(c[0], k), superCount4(c[1], k));
+            s = _mm_add_epi32(_mm_sub_epi32(s, superCount4(c[2], k)),
+                              superCount4(c[3], k));
+            v = _mm_add_epi32(v, s);
+        }
+        acc = accumulate4(acc, v, t);
+    }
+    return finishAvx2(acc, area, t);
+}
+
+#endif // ENTROPY_X86
+
+typedef double (*cornerEntropyFn)(const histCorner *, long,
+                                  const nlognTable &);
+typedef double (*countEntropyFn)(const int32_t *, long, const nlognTable &);
+typedef void (*cornerDiffFn)(const histCorner &, const histCorner &,
+                             int32_t *);
+
+struct kernelTable {
+    simdLevel level;
+    cornerDiffFn diff;
+    cornerEntropyFn corners;
+    countEntropyFn counts;
+};
+
+template <int BINS>
+kernelTable kernelsFor(simdLevel level) {
+    kernelTable t;
+    t.level = SIMD_SCALAR;
+    t.diff = diffScalar<BINS>;
+    t.corners = cornerEntropyScalar<BINS>;
+    t.counts = countEntropyScalar<BINS>;
+#ifdef ENTROPY_X86
+    if (level == SIMD_AVX2) {
+        t.level = SIMD_AVX2;
+        t.diff = diffAvx2<BINS>;
+        t.corners = cornerEntropyAvx2<BINS>;
+        t.counts = countEntropyAvx2<BINS>;
+    } else if (level == SIMD_SSE2) {
+        t.level = SIMD_SSE2;
+        t.diff = diffSse2<BINS>;
+        t.corners = cornerEntropySse2<BINS>;
+        t.counts = countEntropySse2<BINS>;
+    }
+#endif
+    return t;
+}
+
+/**
+ * The kernels in use for BINS bins. setSimdLevel switches the tables of
+ * all bin counts together.
+ */
+template <int BINS>
+kernelTable &kernels() {
+    static kernelTable table = kernelsFor<BINS>(detectSimdLevel());
+    return table;
+}
+
+} // namespace
+
+const long nlognTable::MAX_ENTRIES;
+
+nlognTable::nlognTable(long maxCount) {
+    long n = min(maxCount + 1, MAX_ENTRIES);
+    entries = (int32_t)n;
+    values.resize(n > 0 ? n : 1);
+    for (long i = 0; i < n; i++) {
+        values[i] = direct(i);
+    }
+}
+
+simdLevel detectSimdLevel() {
+#ifdef ENTROPY_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return SIMD_AVX2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return SIMD_SSE2;
+    }
+#endif
+    return SIMD_SCALAR;
+}
+
+simdLevel currentSimdLevel() {
+    return kernels<36>().level;
+}
+
+void setSimdLevel(simdLevel level) {
+    simdLevel best = detectSimdLevel();
+    level = (level < best) ? level : best;
+    kernels<16>() = kernelsFor<16>(level);
+    kernels<36>() = kernelsFor<36>(level);
+    kernels<72>() = kernelsFor<72>(level);
+}
+
+const char *simdLevelName(simdLevel level) {
+    switch (level) {
+    case SIMD_AVX2:
+        return "avx2";
+    case SIMD_SSE2:
+        return "sse2";
+    default:
+        return "scalar";
+    }
+}
+
+template <int BINS>
+void cornerDiff(const histCorner &a, const histCorner &b, int32_t *counts) {
+    kernels<BINS>().diff(a, b, counts);
+}
+
+template <int BINS>
+double cornerEntropy(const histCorner *c, long area, const nlognTable &t) {
+    return kernels<BINS>().corners(c, area, t);
+}
+
+template <int BINS>
+double countEntropy(const int32_t *counts, long area, const nlognTable &t) {
+    return kernels<BINS>().counts(counts, area, t);
+}
+
+#define INSTANTIATE_KERNELS(BINS)                                             \
+    template void cornerDiff<BINS>(const histCorner &, const histCorner &,   \
+                                   int32_t *);                               \
+    template double cornerEntropy<BINS>(const histCorner *, long,            \
+                                        const nlognTable &);                 \
+    template double countEntropy<BINS>(const int32_t *, long,                \
+                                       const nlognTable &);
+
+INSTANTIATE_KERNELS(16)
+INSTANTIATE_KERNELS(36)
+INSTANTIATE_KERNELS(72)
@@ -0,0 +1,135 @@
+/**
+ * @file entropyKernel.h
+ * Vectorized kernels for the innermost step of binnedStats::entropy:
+ * combining the four histogram corners of a rectangle into a BINS-bin
+ * distribution and accumulating its entropy. The kernels are templates on
+ * the bin count, instantiated for the 16, 36 and 72 bins binnedStats is
+ * built with, so every loop over the bins unrolls completely.
+ *
+ * Since every count c_i is an integer, the entropy of n pixels is
+ * evaluated as
+ *
+ *   E = -Sum(p_i log2(p_i)) = (n log2(n) - Sum(c_i log2(c_i))) / n
+ *
+ * with c log2(c) read from a precomputed nlognTable instead of taking a
+ * log per bin. Written this way a region whose pixels share one bin has
+ * an entropy of exactly 0.
+ *
+ * An AVX2 and an SSE2 kernel are provided next to the scalar one, and the
+ * best kernel the CPU supports is picked the first time one is used. All
+ * kernels accumulate bin i into lane i % 4 and reduce the lanes in the
+ * same order, so every kernel returns bit-identical entropies and a tree
+ * never depends on the machine it was built on.
+ */
+
+#ifndef _ENTROPYKERNEL_H_
+#define _ENTROPYKERNEL_H_
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+/**
+ * The five parts of one corner of the tiled hue histogram integral (see
+ * binnedStats::histRows), each pointing at BINS consecutive bins. The
+ * three tile-relative parts never sum past 65535, so kernels may add
+ * them in 16-bit lanes before widening.
+ */
+struct histCorner {
+    const uint32_t *above;
+    const uint32_t *left;
+    const uint16_t *row;
+    const uint16_t *col;
+    const uint8_t *local;
+};
+
+/**
+ * n * log2(n) for every integer count a histogram of a given image can
+ * hold. The table covers counts up to the image area, capped at
+ * MAX_ENTRIES; larger counts (gigapixel images) are computed on the fly
+ * with the same expression, so results never depend on the table size.
+ */
+class nlognTable {
+public:
+    static const long MAX_ENTRIES = 1L << 20;
+
+    /**
+     * Builds the table for counts in [0, maxCount].
+     */
+    explicit nlognTable(long maxCount = 0);
+
+    /**
+     * Returns n * log2(n), and 0 for n = 0.
+     */
+    double operator()(long n) const {
+        return (n < entries) ? values[n] : direct(n);
+    }
+
+    /**
+     * Returns n * log2(n) without the table.
+     */
+    static double direct(long n) {
+        return (n == 0) ? 0.0 : (double)n * std::log2((double)n);
+    }
+
+    const double *data() const {
+        return &values[0];
+    }
+
+    int32_t size() const {
+        return entries;
+    }
+
+private:
+    int32_t entries;
+    std::vector<double> values;
+};
+
+/**
+ * Instruction sets a kernel can be built for, from slowest to fastest.
+ */
+enum simdLevel { SIMD_SCALAR, SIMD_SSE2, SIMD_AVX2 };
+
+/**
+ * Returns the fastest instruction set supported by this CPU.
+ */
+simdLevel detectSimdLevel();
+
+/**
+ * Returns the instruction set of the kernels currently in use.
+ */
+simdLevel currentSimdLevel();
+
+/**
+ * Forces the kernels to a given instruction set, e.g. for benchmarking.
+ * Requests above what the CPU supports are clamped to detectSimdLevel().
+ */
+void setSimdLevel(simdLevel level);
+
+/**
+ * Returns a printable name for an instruction set.
+ */
+const char *simdLevelName(simdLevel level);
+
+/**
+ * Fills counts with the BINS-bin histogram difference a - b of two
+ * corners. BINS is 16, 36 or 72, and counts must be 16-byte aligned.
+ */
+template <int BINS>
+void cornerDiff(const histCorner &a, const histCorner &b, int32_t *counts);
+
+/**
+ * Returns the entropy of the rectangle whose BINS-bin histogram is
+ * c[0] - c[1] - c[2] + c[3], which holds area pixels in total.
+ */
+template <int BINS>
+double cornerEntropy(const histCorner *c, long area, const nlognTable &t);
+
+/**
+ * Returns the entropy of a BINS-bin distribution holding area pixels.
+ * counts must be 16-byte aligned.
+ */
+template <int BINS>
+double countEntropy(const int32_t *counts, long area, const nlognTable &t);
+
+#endif
@@ -0,0 +1,125 @@
+/**
+ * @file flatTable.h
+ * A flat array of table cells that either owns its storage or views
+ * cells stored elsewhere, such as a memory-mapped cache file (see
+ * mappedFile.h). Reads and writes go through the same pointer in both
+ * cases, so code indexing a table does not care where it lives.
+ */
+
+#ifndef _FLATTABLE_H_
+#define _FLATTABLE_H_
+
+#include "alignedAllocator.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+template <class T>
+class flatTable {
+public:
+    flatTable() : cells(NULL), count(0) {}
+
+    flatTable(const flatTable &other) {
+        copyFrom(other);
+    }
+
+    flatTable &operator=(const flatTable &other) {
+        if (this != &other) {
+            copyFrom(other);
+        }
+        return *this;
+    }
+
+    // moving a vector keeps its buffer, so cells stays valid
+    flatTable(flatTable &&other) noexcept
+        : owned(std::move(other.owned)), cells(other.cells),
+          count(other.count) {
+        other.cells = NULL;
+        other.count = 0;
+    }
+
+    flatTable &operator=(flatTable &&other) noexcept {
+        if (this != &other) {
+            owned = std::move(other.owned);
+            cells = other.cells;
+            count = other.count;
+            other.cells = NULL;
+            other.count = 0;
+        }
+        return *this;
+    }
+
+    /**
+     * Owns n cells, all set to value.
+     */
+    void assign(std::size_t n, const T &value) {
+        owned.assign(n, value);
+        cells = owned.empty() ? NULL : &owned[0];
+        count = n;
+    }
+
+    /**
+     * Views n cells at data without owning them; data must outlive the
+     * table.
+     */
+    void view(T *data, std::size_t n) {
+        owned.clear();
+        owned.shrink_to_fit();
+        cells = data;
+        count = n;
+    }
+
+    /**
+     * True if the cells are not owned by the table.
+     */
+    bool isView() const {
+        return count > 0 && owned.empty();
+    }
+
+    T &operator[](std::size_t i) {
+        return cells[i];
+    }
+
+    const T &operator[](std::size_t i) const {
+        return cells[i];
+    }
+
+    T *data() {
+        return cells;
+    }
+
+    const T *data() const {
+        return cells;
+    }
+
+    std::size_t size() const {
+        return count;
+    }
+
+    bool empty() const {
+        return count == 0;
+    }
+
+    bool operator==(const flatTable &other) const {
+        return count == other.count &&
+               std::equal(cells, cells + count, other.cells);
+    }
+
+private:
+    /**
+     * Copies owned cells, and shares viewed ones.
+     */
+    void copyFrom(const flatTable &other) {
+        owned = other.owned;
+        cells = owned.empty() ? other.cells : &owned[0];
+        count = other.count;
+    }
+
+    std::vector<T, alignedAllocator<T>> owned;
+    T *cells;
+    std::size_t count;
+};
+
+#endif
@@ -20,26 +20,13 @@ int main() {
     // use it to build a twoDtree
     twoDtree t1(origIm1);
 
-    // make some copies for pruning tests
-    twoDtree tCopy1(t1);
-    twoDtree tCopy2(t1);
-    twoDtree tCopy3(t1);
-    twoDtree tCopy4(t1);
-
-    // prune the twoDtree
-    // where all subtree pixels are within Y of mean
-
-    tCopy1.prune(.2);
-    tCopy2.prune(.1);
-    tCopy3.prune(.05);
-    tCopy4.prune(.025);
-
-    // render the twoDtree
+    // render the twoDtree, and as pruned where all subtree pixels are
+    // within Y of mean; render(Y) leaves the tree itself unpruned
     PNG ppic1 = t1.render();
-    PNG ppiccopy1 = tCopy1.render();
-    PNG ppiccopy2 = tCopy2.render();
-    PNG ppiccopy3 = tCopy3.render();
-    PNG ppiccopy4 = tCopy4.render();
+    PNG ppiccopy1 = t1.render(.2);
+    PNG ppiccopy2 = t1.render(.1);
+    PNG ppiccopy3 = t1.render(.05);
+    PNG ppiccopy4 = t1.render(.025);
 
     // write the pngs to files.
     ppic1.writeToFile("images/output-CP.png");
@@ -0,0 +1,35 @@
+#include "mappedFile.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+shared_ptr<mappedFile> mappedFile::open(const string &fileName) {
+    int fd = ::open(fileName.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return shared_ptr<mappedFile>();
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        close(fd);
+        return shared_ptr<mappedFile>();
+    }
+    void *p = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd,
+                   0);
+    // the mapping keeps the file alive on its own
+    close(fd);
+    if (p == MAP_FAILED) {
+        return shared_ptr<mappedFile>();
+    }
+    return shared_ptr<mappedFile>(new mappedFile((char *)p, st.st_size));
+}
+
+mappedFile::mappedFile(char *base, size_t length)
+    : base(base), length(length) {}
+
+mappedFile::~mappedFile() {
+    munmap(base, length);
+}
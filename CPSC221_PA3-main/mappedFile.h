@@ -0,0 +1,42 @@
+/**
+ * @file mappedFile.h
+ * A file mapped into memory for as long as the object lives. Pages are
+ * mapped copy-on-write: reads come straight from the page cache, which
+ * every process mapping the same file shares, and writes stay private.
+ */
+
+#ifndef _MAPPEDFILE_H_
+#define _MAPPEDFILE_H_
+
+#include <cstddef>
+#include <memory>
+#include <string>
+
+class mappedFile {
+public:
+    /**
+     * Maps the whole of the given file. Returns NULL if the file cannot
+     * be opened or mapped.
+     */
+    static std::shared_ptr<mappedFile> open(const std::string &fileName);
+
+    ~mappedFile();
+
+    char *data() {
+        return base;
+    }
+
+    std::size_t size() const {
+        return length;
+    }
+
+private:
+    mappedFile(char *base, std::size_t length);
+    mappedFile(const mappedFile &);
+    mappedFile &operator=(const mappedFile &);
+
+    char *base;
+    std::size_t length;
+};
+
+#endif
@@ -0,0 +1,70 @@
+#include "packedTree.h"
+#include "cs221util/RGB_HSL.h"
+
+packedTree::packedTree() : width(0), height(0) {}
+
+size_t packedTree::size() const {
+    return nodes.size();
+}
+
+bool packedTree::operator==(const packedTree &other) const {
+    if (width != other.width || height != other.height ||
+        nodes.size() != other.nodes.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < nodes.size(); i++) {
+        const packedNode &a = nodes[i], &b = other.nodes[i];
+        if (a.split != b.split || a.r != b.r || a.g != b.g || a.b != b.b ||
+            a.a != b.a) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool packedTree::operator!=(const packedTree &other) const {
+    return !(*this == other);
+}
+
+void packedTree::add(const HSLAPixel &avg, uint32_t split) {
+    static_assert(sizeof(packedNode) == 8, "packed nodes are 8 bytes");
+    hslaColor hsl = {avg.h, avg.s, avg.l, avg.a};
+    rgbaColor rgb = hsl2rgb(hsl);
+    packedNode node = {rgb.r, rgb.g, rgb.b, rgb.a, split};
+    nodes.push_back(node);
+}
+
+PNG packedTree::render() const {
+    PNG img(width, height);
+    // nodes are in preorder, so each one read covers the rectangle on top
+    // of the stack, and a split pushes RB's rectangle below LT's
+    vector<pair<pair<int, int>, pair<int, int>>> pending;
+    if (!nodes.empty()) {
+        pending.push_back(make_pair(pair<int, int>(0, 0),
+                                    pair<int, int>(width - 1, height - 1)));
+    }
+    size_t i = 0;
+    while (!pending.empty()) {
+        pair<int, int> ul = pending.back().first;
+        pair<int, int> lr = pending.back().second;
+        pending.pop_back();
+        const packedNode &node = nodes[i++];
+        if (node.split & LEAF) {
+            rgbaColor rgb = {node.r, node.g, node.b, node.a};
+            hslaColor hsl = rgb2hsl(rgb);
+            HSLAPixel color(hsl.h, hsl.s, hsl.l, hsl.a);
+            for (int y = ul.second; y <= lr.second; y++) {
+                for (int x = ul.first; x <= lr.first; x++) {
+                    *img.getPixel(x, y) = color;
+                }
+            }
+        } else {
+            pair<int, int> ltlr, rbul;
+            splitRect(node.split & VERT, node.split & ~VERT, ul, lr, ltlr,
+                      rbul);
+            pending.push_back(make_pair(rbul, lr));
+            pending.push_back(make_pair(ul, ltlr));
+        }
+    }
+    return img;
+}
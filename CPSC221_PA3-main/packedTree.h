@@ -0,0 +1,93 @@
+/**
+ * @file packedTree.h
+ * A read-only copy of a twoDtree in 8 bytes per node, for keeping large
+ * trees in memory. Nodes are stored in preorder, so a node's LT child is
+ * the node after it and its RB child the node after its LT subtree;
+ * neither index is stored. A node keeps its color as 8-bit RGBA, which
+ * is what PNG::writeToFile stores anyway, and its split line, from which
+ * the rectangles are recomputed while walking the tree.
+ */
+
+#ifndef _PACKEDTREE_H_
+#define _PACKEDTREE_H_
+
+#include "cs221util/HSLAPixel.h"
+#include "cs221util/PNG.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+using namespace std;
+using namespace cs221util;
+
+/**
+ * Finds the children of the rectangle ul, lr split after column (vert)
+ * or row line: LT is ul, ltlr and RB is rbul, lr.
+ */
+inline void splitRect(bool vert, int line, pair<int, int> ul,
+                      pair<int, int> lr, pair<int, int> &ltlr,
+                      pair<int, int> &rbul) {
+    if (vert) {
+        ltlr = pair<int, int>(line, lr.second);
+        rbul = pair<int, int>(line + 1, ul.second);
+    } else {
+        ltlr = pair<int, int>(lr.first, line);
+        rbul = pair<int, int>(ul.first, line + 1);
+    }
+}
+
+class packedTree {
+public:
+    /**
+     * An empty tree, of a 0x0 image. See twoDtree::pack.
+     */
+    packedTree();
+
+    /**
+     * Returns the image of the tree, as twoDtree::render does, with
+     * colors rounded to 8 bits per channel.
+     */
+    PNG render() const;
+
+    /**
+     * Returns the number of nodes in the tree.
+     */
+    size_t size() const;
+
+    /**
+     * Returns true if both trees are of the same image size and have
+     * the same nodes in the same order: every split, and so every
+     * rectangle, is the same, as is every packed color.
+     */
+    bool operator==(const packedTree &other) const;
+
+    /**
+     * Returns true if the trees differ in any way operator== checks.
+     */
+    bool operator!=(const packedTree &other) const;
+
+private:
+    friend class twoDtree;
+
+    // split word: LEAF, or VERT for a vertical split, or'd with the line
+    static const uint32_t LEAF = 1u << 31;
+    static const uint32_t VERT = 1u << 30;
+
+    struct packedNode {
+        uint8_t r, g, b, a;
+        uint32_t split;
+    };
+
+    /**
+     * Appends a node of the given color and split word.
+     */
+    void add(const HSLAPixel &avg, uint32_t split);
+
+    vector<packedNode> nodes;
+    int width;
+    int height;
+};
+
+#endif
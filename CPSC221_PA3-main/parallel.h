@@ -0,0 +1,62 @@
+/**
+ * @file parallel.h
+ * Fork-join helper for loops whose iterations are independent.
+ */
+
+#ifndef _PARALLEL_H_
+#define _PARALLEL_H_
+
+#include <thread>
+#include <vector>
+
+/**
+ * Returns the number of threads to use for a requested count: the
+ * request itself, or every hardware thread when it is 0 or less.
+ */
+inline int resolveThreads(int threads) {
+    if (threads > 0) {
+        return threads;
+    }
+    int hw = (int)std::thread::hardware_concurrency();
+    return (hw > 0) ? hw : 1;
+}
+
+/**
+ * Calls body(lo, hi) on contiguous chunks covering [begin, end), one
+ * chunk per thread, and returns once every chunk is done. The calling
+ * thread runs the first chunk itself. Chunks are fixed by the range and
+ * thread count alone, so a body writing only to its own indices gives
+ * the same result as a single call body(begin, end).
+ *
+ * @param begin first index of the range
+ * @param end one past the last index of the range
+ * @param threads number of threads, see resolveThreads
+ * @param body callable taking the bounds (lo, hi) of one chunk
+ */
+template <class F>
+void parallelFor(long begin, long end, int threads, F body) {
+    long n = end - begin;
+    long chunks = resolveThreads(threads);
+    if (chunks > n) {
+        chunks = n;
+    }
+    if (chunks <= 1) {
+        if (n > 0) {
+            body(begin, end);
+        }
+        return;
+    }
+    std::vector<std::thread> workers;
+    workers.reserve(chunks - 1);
+    for (long c = 1; c < chunks; c++) {
+        long lo = begin + n * c / chunks;
+        long hi = begin + n * (c + 1) / chunks;
+        workers.push_back(std::thread([=]() { body(lo, hi); }));
+    }
+    body(begin, begin + n / chunks);
+    for (size_t i = 0; i < workers.size(); i++) {
+        workers[i].join();
+    }
+}
+
+#endif
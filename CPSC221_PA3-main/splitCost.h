@@ -0,0 +1,93 @@
+/**
+ * @file splitCost.h
+ * Split cost policies for twoDtree. A policy scores splitting a
+ * rectangle along a line, and the tree takes the line scoring lowest.
+ * Each policy provides
+ *
+ *   void prepare(S &s, PNG &im, int threads) const
+ *       builds any extra tables the cost needs into the stats s of im
+ *   double operator()(S &s, ul, lr, bool vert, int line) const
+ *       the cost of splitting the rectangle ul, lr after column (vert) or
+ *       row line, so that line is the last one of the LT child
+ *   double gain(S &s, ul, lr, double split) const
+ *       how much splitting the rectangle ul, lr at cost split improves on
+ *       leaving it whole, in units comparable between rectangles; the
+ *       best-first build (buildOptions::maxLeaves) splits the largest
+ *
+ * where S is a binnedStats.
+ */
+
+#ifndef _SPLITCOST_H_
+#define _SPLITCOST_H_
+
+#include "cs221util/PNG.h"
+
+#include <utility>
+
+using namespace std;
+using namespace cs221util;
+
+/**
+ * The cost described in the spec: the entropy of the hue histograms of
+ * the two halves, weighted by their areas. twoDtree evaluates it with an
+ * incremental sweep unless a scan is asked for (buildOptions::search).
+ */
+struct entropyCost {
+    template <class S>
+    void prepare(S &, PNG &, int) const {}
+
+    template <class S>
+    double operator()(S &s, pair<int, int> ul, pair<int, int> lr, bool vert,
+                      int line) const {
+        if (vert) {
+            return s.weightedSumEntropy(ul, pair<int, int>(line, lr.second),
+                                        pair<int, int>(line + 1, ul.second),
+                                        lr);
+        }
+        return s.weightedSumEntropy(ul, pair<int, int>(lr.first, line),
+                                    pair<int, int>(ul.first, line + 1), lr);
+    }
+
+    // the split weighs the entropies by area fraction, so the reduction
+    // of the total entropy over the rectangle's pixels is area times the
+    // drop
+    template <class S>
+    double gain(S &s, pair<int, int> ul, pair<int, int> lr,
+                double split) const {
+        return s.rectArea(ul, lr) * (s.entropy(ul, lr) - split);
+    }
+};
+
+/**
+ * The total squared color error of the two halves, in the color space of
+ * HSLAPixel::dist: each half is summarized by its mean color, and this is
+ * the sum of the squared distances of the pixels to their half's mean.
+ * It reads eight corners of the moment table per line, rather than
+ * hundreds of histogram bins, and so builds trees several times faster,
+ * whose leaves fit the average colors prune() and render() use.
+ */
+struct varianceCost {
+    template <class S>
+    void prepare(S &s, PNG &im, int threads) const {
+        s.buildMoments(im, threads);
+    }
+
+    template <class S>
+    double operator()(S &s, pair<int, int> ul, pair<int, int> lr, bool vert,
+                      int line) const {
+        if (vert) {
+            return s.sse(ul, pair<int, int>(line, lr.second)) +
+                   s.sse(pair<int, int>(line + 1, ul.second), lr);
+        }
+        return s.sse(ul, pair<int, int>(lr.first, line)) +
+               s.sse(pair<int, int>(ul.first, line + 1), lr);
+    }
+
+    template <class S>
+    double gain(S &s, pair<int, int> ul, pair<int, int> lr,
+                double split) const {
+        return s.sse(ul, lr) - split;
+    }
+};
+
+#endif
@@ -1,120 +1,331 @@
 #include "stats.h"
 
-stats::stats(PNG &im) {
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <sstream>
+#include <unistd.h>
+
+namespace {
+
+/**
+ * Layout of a stats cache file: this header, then the five tables of
+ * binnedStats in the order of tableNames, each starting on a 64-byte
+ * boundary so the mapped tables keep the alignment of built ones. The
+ * file is in the byte order of the machine that wrote it.
+ */
+struct cacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;
+    uint64_t hash;
+    uint32_t width;
+    uint32_t height;
+    uint32_t bins;
+    uint32_t tile;
+    uint32_t mode;
+    uint32_t superTile;
+    double hueScale;
+    double slScale;
+    uint64_t offset[7];
+    uint64_t bytes[7];
+};
+
+const char CACHE_MAGIC[8] = {'P', 'A', '3', 'S', 'T', 'A', 'T', 'S'};
+// bump whenever the table layout or cacheHeader changes
+const uint32_t CACHE_VERSION = 2;
+const int CACHE_TABLES = 7;
+const uint32_t CACHE_BYTE_ORDER = 0x01020304;
+const uint64_t CACHE_ALIGN = 64;
+
+uint64_t alignUp(uint64_t n) {
+    return (n + CACHE_ALIGN - 1) / CACHE_ALIGN * CACHE_ALIGN;
+}
+
+const char *modeName(satMode mode) {
+    switch (mode) {
+    case SAT_FIXED64:
+        return "fixed64";
+    case SAT_QUANT8:
+        return "quant8";
+    default:
+        return "double";
+    }
+}
+
+} // namespace
+
+imageKey::imageKey(const PNG &im)
+    : hash(im.computeHash()), width(im.width()), height(im.height()) {}
+
+template <int BINS>
+const int binnedStats<BINS>::HIST_BINS;
+template <int BINS>
+const int binnedStats<BINS>::HIST_TILE;
+template <int BINS>
+const int binnedStats<BINS>::HIST_SUPER;
+template <int BINS>
+constexpr double binnedStats<BINS>::BIN_WIDTH;
+
+template <int BINS>
+binnedStats<BINS>::binnedStats()
+    : mode(SAT_DOUBLE), hueScale(1.0), slScale(1.0), stride(1),
+      tileStride(1), superStride(1), localStride(1) {}
+
+template <int BINS>
+binnedStats<BINS>::binnedStats(PNG &im, int threads, satMode mode)
+    : mode(mode) {
     // resize all private vectors
-    sumHueX.resize(im.width());
-    sumHueY.resize(im.width());
-    sumSat.resize(im.width());
-    sumLum.resize(im.width());
-    hist.resize(im.width());
-    for (unsigned x = 0; x < im.width(); x++) {
-        sumHueX[x].resize(im.height(), 0);
-        sumHueY[x].resize(im.height(), 0);
-        sumSat[x].resize(im.height(), 0);
-        sumLum[x].resize(im.height(), 0);
-        hist[x].resize(im.height());
-        for (unsigned y = 0; y < im.height(); y++) {
-            hist[x][y].resize(36, 0);
+    stride = im.width() + 1;
+    if (mode == SAT_DOUBLE) {
+        sums.assign(stride * (im.height() + 1), sumCell());
+    } else {
+        fixedSums.assign(stride * (im.height() + 1), fixedCell());
+    }
+    hueScale = (mode == SAT_QUANT8) ? 127.0 : 4294967296.0; // 2^32
+    slScale = (mode == SAT_QUANT8) ? 255.0 : 4294967296.0;
+    tileStride = im.width() / HIST_TILE + 1;
+    superStride = im.width() / HIST_SUPER + 1;
+    histAbove.assign((im.height() / HIST_SUPER + 1) * stride * HIST_BINS, 0);
+    histLeft.assign((im.height() + 1) * superStride * HIST_BINS, 0);
+    histRows.assign((im.height() / HIST_TILE + 1) * stride * HIST_BINS, 0);
+    histCols.assign((im.height() + 1) * tileStride * HIST_BINS, 0);
+    localStride = im.width() - im.width() / HIST_TILE + 1;
+    histLocal.assign((im.height() - im.height() / HIST_TILE + 1) *
+                         localStride * HIST_BINS,
+                     0);
+    nlogn = nlognTable((long)im.width() * im.height());
+
+    buildSums(im, threads);
+    buildHist(im, threads);
+}
+
+template <int BINS>
+template <class Cell, class CellOf>
+void binnedStats<BINS>::prefixSums(flatTable<Cell> &table, PNG &im,
+                                   int threads, CellOf cell) {
+    // row pass: corner row y+1 holds the prefix sums of pixel row y alone
+    parallelFor(0, im.height(), threads, [&](long lo, long hi) {
+        for (long y = lo; y < hi; y++) {
+            Cell *curr = &table[(y + 1) * stride];
+            for (unsigned x = 0; x < im.width(); x++) {
+                curr[x + 1] = curr[x];
+                curr[x + 1].add(cell(im.getPixel(x, y)));
+            }
+        }
+    });
+
+    // column pass: add each corner row onto the one below it. Every
+    // thread owns a range of columns and walks it top to bottom.
+    parallelFor(1, stride, threads, [&](long lo, long hi) {
+        for (size_t y = 2; y <= im.height(); y++) {
+            const Cell *above = &table[(y - 1) * stride];
+            Cell *curr = &table[y * stride];
+            for (long x = lo; x < hi; x++) {
+                curr[x].add(above[x]);
+            }
         }
+    });
+}
+
+template <int BINS>
+void binnedStats<BINS>::buildSums(PNG &im, int threads) {
+    if (mode == SAT_DOUBLE) {
+        prefixSums(sums, im, threads, [](const HSLAPixel *p) {
+            sumCell c = {cos(p->h * PI / 180), sin(p->h * PI / 180), p->s,
+                         p->l};
+            return c;
+        });
+        return;
     }
+    double hs = hueScale, ss = slScale;
+    prefixSums(fixedSums, im, threads, [hs, ss](const HSLAPixel *p) {
+        fixedCell c = {llround(cos(p->h * PI / 180) * hs),
+                       llround(sin(p->h * PI / 180) * hs), llround(p->s * ss),
+                       llround(p->l * ss)};
+        return c;
+    });
+}
+
+template <int BINS>
+void binnedStats<BINS>::buildHist(PNG &im, int threads) {
+    // row pass, one tile row at a time: histCols and histLocal only see
+    // pixels of their own tile row, histLeft counts from its top, and
+    // histRows of the tile row below first collects the counts of this
+    // one alone
+    long tileRows = (im.height() + HIST_TILE - 1) / HIST_TILE;
+    parallelFor(0, tileRows, threads, [&](long lo, long hi) {
+        for (long t = lo; t < hi; t++) {
+            unsigned yEnd = min<unsigned>((t + 1) * HIST_TILE, im.height());
+            for (unsigned y = t * HIST_TILE; y < yEnd; y++) {
+                histRow(im, y);
+            }
+        }
+    });
+
+    // column pass over histLeft: each tile row adds the count of the
+    // rows above it in its super tile row. The count of a whole super
+    // tile row goes to closing, since histLeft restarts from zero there.
+    size_t leftSize = superStride * HIST_BINS;
+    vector<uint32_t> closing((im.height() / HIST_SUPER + 1) * leftSize, 0);
+    parallelFor(0, leftSize, threads, [&](long lo, long hi) {
+        for (long i = lo; i < hi; i++) {
+            uint32_t top = 0; // the value at the top of the tile row
+            for (size_t y = 1; y <= im.height(); y++) {
+                uint32_t &v = histLeft[y * leftSize + i];
+                if (y % HIST_TILE != 0) {
+                    v += top;
+                } else if (y % HIST_SUPER != 0) {
+                    v += top;
+                    top = v;
+                } else {
+                    closing[y / HIST_SUPER * leftSize + i] = top + v;
+                    v = 0;
+                    top = 0;
+                }
+            }
+        }
+    });
 
-    // initialize HSL channels and histogram of hues
-    for (unsigned x = 0; x < im.width(); x++) {
-        for (unsigned y = 0; y < im.height(); y++) {
-            HSLAPixel *currPixel = im.getPixel(x, y);
-
-            // initialize cumulative sum of hueX
-            double currHueX = cos(currPixel->h * PI / 180);
-            double aboveSumHueX = (y > 0) ? sumHueX[x][y - 1] : 0;
-            double leftSumHueX = (x > 0) ? sumHueX[x - 1][y] : 0;
-            double aboveLeftSumHueX =
-                (x > 0 && y > 0) ? sumHueX[x - 1][y - 1] : 0;
-            sumHueX[x][y] =
-                currHueX + aboveSumHueX + leftSumHueX - aboveLeftSumHueX;
-
-            // initialize cumulative sum of hueY
-            double currHueY = sin(currPixel->h * PI / 180);
-            double aboveSumHueY = (y > 0) ? sumHueY[x][y - 1] : 0;
-            double leftSumHueY = (x > 0) ? sumHueY[x - 1][y] : 0;
-            double aboveLeftSumHueY =
-                (x > 0 && y > 0) ? sumHueY[x - 1][y - 1] : 0;
-            sumHueY[x][y] =
-                currHueY + aboveSumHueY + leftSumHueY - aboveLeftSumHueY;
-
-            // initialize cumulative sum of saturation
-            double currSat = currPixel->s;
-            double aboveSumSat = (y > 0) ? sumSat[x][y - 1] : 0;
-            double leftSumSat = (x > 0) ? sumSat[x - 1][y] : 0;
-            double aboveLeftSat = (x > 0 && y > 0) ? sumSat[x - 1][y - 1] : 0;
-            sumSat[x][y] = currSat + aboveSumSat + leftSumSat - aboveLeftSat;
-
-            // initialize cumulative sum of luminance
-            double currLum = currPixel->l;
-            double aboveSumLum = (y > 0) ? sumLum[x][y - 1] : 0;
-            double leftSumLum = (x > 0) ? sumLum[x - 1][y] : 0;
-            double aboveLeftLum = (x > 0 && y > 0) ? sumLum[x - 1][y - 1] : 0;
-            sumLum[x][y] = currLum + aboveSumLum + leftSumLum - aboveLeftLum;
-
-            // initialize histogram of hue
-            int k = currPixel->h / 10;
-            vector<int> aboveHist =
-                (y > 0) ? hist[x][y - 1] : vector<int>(36, 0);
-            vector<int> leftHist =
-                (x > 0) ? hist[x - 1][y] : vector<int>(36, 0);
-            vector<int> aboveLeftHist =
-                (x > 0 && y > 0) ? hist[x - 1][y - 1] : vector<int>(36, 0);
-            hist[x][y][k]++;
-            transform(hist[x][y].begin(), hist[x][y].end(), aboveHist.begin(),
-                      hist[x][y].begin(), plus<int>());
-            transform(hist[x][y].begin(), hist[x][y].end(), leftHist.begin(),
-                      hist[x][y].begin(), plus<int>());
-            transform(hist[x][y].begin(), hist[x][y].end(),
-                      aboveLeftHist.begin(), hist[x][y].begin(), minus<int>());
+    // column pass: prefix sums of histRows down the tile rows of every
+    // super tile row, and of histAbove down the super tile rows
+    size_t rowSize = stride * HIST_BINS;
+    size_t bands = histRows.size() / rowSize;
+    parallelFor(0, rowSize, threads, [&](long lo, long hi) {
+        for (size_t ty = 1; ty < bands; ty++) {
+            uint16_t *row = &histRows[ty * rowSize];
+            const uint16_t *above = row - rowSize;
+            if (ty * HIST_TILE % HIST_SUPER != 0) {
+                for (long i = lo; i < hi; i++) {
+                    row[i] += above[i];
+                }
+                continue;
+            }
+            size_t sy = ty * HIST_TILE / HIST_SUPER;
+            uint32_t *total = &histAbove[sy * rowSize];
+            const uint32_t *left = &closing[sy * leftSize];
+            for (long i = lo; i < hi; i++) {
+                size_t sx = i / HIST_BINS / HIST_SUPER;
+                total[i] = total[i - rowSize] +
+                           left[sx * HIST_BINS + i % HIST_BINS] +
+                           (uint32_t)above[i] + row[i];
+                row[i] = 0;
+            }
         }
+    });
+}
+
+template <int BINS>
+void binnedStats<BINS>::histRow(PNG &im, unsigned y) {
+    unsigned cy = y + 1;
+    bool tileTop = (cy % HIST_TILE == 0);
+    bool firstRow = (y % HIST_TILE == 0);
+    // the tile row's own counts, folded into histRows by buildHist;
+    // partial tile rows at the bottom have no histRows entry
+    uint16_t *band = NULL;
+    size_t ty = y / HIST_TILE + 1;
+    if (ty * HIST_TILE <= im.height()) {
+        band = &histRows[ty * stride * HIST_BINS];
     }
+    int run[HIST_BINS] = {0};      // pixels left of x in row y
+    int superRun[HIST_BINS] = {0}; // ... and right of the super tile's X0
+    int tileRun[HIST_BINS] = {0};  // ... and right of the tile's x0
+    for (unsigned x = 0; x <= im.width(); x++) {
+        if (x > 0) {
+            HSLAPixel *currPixel = im.getPixel(x - 1, y);
+            int k = (int)(currPixel->h / BIN_WIDTH) % BINS;
+            run[k]++;
+            superRun[k]++;
+            tileRun[k]++;
+        }
+        if (x % HIST_SUPER == 0) {
+            fill(superRun, superRun + HIST_BINS, 0);
+            size_t sx = x / HIST_SUPER;
+            uint32_t *left = &histLeft[(cy * superStride + sx) * HIST_BINS];
+            const uint32_t *above = left - superStride * HIST_BINS;
+            for (int k = 0; k < HIST_BINS; k++) {
+                left[k] = (firstRow ? 0 : above[k]) + run[k];
+            }
+        }
+        if (x % HIST_TILE == 0) {
+            fill(tileRun, tileRun + HIST_BINS, 0);
+            if (!tileTop) {
+                size_t tx = x / HIST_TILE;
+                uint16_t *col = &histCols[(cy * tileStride + tx) * HIST_BINS];
+                const uint16_t *above = col - tileStride * HIST_BINS;
+                for (int k = 0; k < HIST_BINS; k++) {
+                    col[k] = above[k] + superRun[k];
+                }
+            }
+        }
+        if (!tileTop && x % HIST_TILE != 0) {
+            size_t lx = x - x / HIST_TILE, ly = cy - cy / HIST_TILE;
+            uint8_t *local = &histLocal[(ly * localStride + lx) * HIST_BINS];
+            const uint8_t *above = local - localStride * HIST_BINS;
+            for (int k = 0; k < HIST_BINS; k++) {
+                local[k] = (firstRow ? 0 : above[k]) + tileRun[k];
+            }
+        }
+        if (band != NULL) {
+            uint16_t *b = &band[x * HIST_BINS];
+            for (int k = 0; k < HIST_BINS; k++) {
+                b[k] += superRun[k];
+            }
+        }
+    }
+}
+
+template <int BINS>
+inline histCorner binnedStats<BINS>::histAt(int x, int y) {
+    size_t cx = x, cy = y; // unsigned, so the tile math is shifts
+    histCorner c;
+    c.above = &histAbove[((cy / HIST_SUPER) * stride + cx) * HIST_BINS];
+    c.left = &histLeft[(cy * superStride + cx / HIST_SUPER) * HIST_BINS];
+    c.row = &histRows[((cy / HIST_TILE) * stride + cx) * HIST_BINS];
+    c.col = &histCols[(cy * tileStride + cx / HIST_TILE) * HIST_BINS];
+    // corners on tile borders share the zero column and row 0, picked
+    // with a mask rather than a branch
+    size_t lx = cx - cx / HIST_TILE, ly = cy - cy / HIST_TILE;
+    lx &= -(size_t)(cx % HIST_TILE != 0);
+    ly &= -(size_t)(cy % HIST_TILE != 0);
+    c.local = &histLocal[(ly * localStride + lx) * HIST_BINS];
+    return c;
 }
 
-long stats::rectArea(pair<int, int> ul, pair<int, int> lr) {
+template <int BINS>
+long binnedStats<BINS>::rectArea(pair<int, int> ul, pair<int, int> lr) {
     int x0 = ul.first, y0 = ul.second;
     int x1 = lr.first, y1 = lr.second;
-    return (x1 - x0 + 1) * (y1 - y0 + 1);
+    return (long)(x1 - x0 + 1) * (y1 - y0 + 1);
 }
 
-HSLAPixel stats::getAvg(pair<int, int> ul, pair<int, int> lr) {
+template <int BINS>
+HSLAPixel binnedStats<BINS>::getAvg(pair<int, int> ul, pair<int, int> lr) {
     int x0 = ul.first, y0 = ul.second;
     int x1 = lr.first, y1 = lr.second;
-    double hue = 0.0, hueX = 0.0, hueY = 0.0;
-    double sat = 0.0;
-    double lum = 0.0;
-
-    if (x0 > 0 && y0 > 0) {
-        // not at edge
-        hueX = sumHueX[x1][y1] - sumHueX[x1][y0 - 1] - sumHueX[x0 - 1][y1] +
-               sumHueX[x0 - 1][y0 - 1];
-        hueY = sumHueY[x1][y1] - sumHueY[x1][y0 - 1] - sumHueY[x0 - 1][y1] +
-               sumHueY[x0 - 1][y0 - 1];
-        sat = sumSat[x1][y1] - sumSat[x1][y0 - 1] - sumSat[x0 - 1][y1] +
-              sumSat[x0 - 1][y0 - 1];
-        lum = sumLum[x1][y1] - sumLum[x1][y0 - 1] - sumLum[x0 - 1][y1] +
-              sumLum[x0 - 1][y0 - 1];
-    } else if (x0 == 0 && y0 > 0) {
-        // at left edge
-        hueX = sumHueX[x1][y1] - sumHueX[x1][y0 - 1];
-        hueY = sumHueY[x1][y1] - sumHueY[x1][y0 - 1];
-        sat = sumSat[x1][y1] - sumSat[x1][y0 - 1];
-        lum = sumLum[x1][y1] - sumLum[x1][y0 - 1];
-    } else if (x0 > 0 && y0 == 0) {
-        // at upper edge
-        hueX = sumHueX[x1][y1] - sumHueX[x0 - 1][y1];
-        hueY = sumHueY[x1][y1] - sumHueY[x0 - 1][y1];
-        sat = sumSat[x1][y1] - sumSat[x0 - 1][y1];
-        lum = sumLum[x1][y1] - sumLum[x0 - 1][y1];
+    size_t ia = y0 * stride + x0;           // upper-left
+    size_t ib = y0 * stride + x1 + 1;       // upper-right
+    size_t ic = (y1 + 1) * stride + x0;     // lower-left
+    size_t id = (y1 + 1) * stride + x1 + 1; // lower-right
+
+    double hue = 0.0;
+    double hueX, hueY, sat, lum;
+    if (mode == SAT_DOUBLE) {
+        const sumCell &a = sums[ia], &b = sums[ib];
+        const sumCell &c = sums[ic], &d = sums[id];
+        hueX = d.hueX - b.hueX - c.hueX + a.hueX;
+        hueY = d.hueY - b.hueY - c.hueY + a.hueY;
+        sat = d.sat - b.sat - c.sat + a.sat;
+        lum = d.lum - b.lum - c.lum + a.lum;
     } else {
-        // at upper-left corner
-        hueX = sumHueX[x1][y1];
-        hueY = sumHueY[x1][y1];
-        sat = sumSat[x1][y1];
-        lum = sumLum[x1][y1];
+        // exact integer sums, scaled back once
+        const fixedCell &a = fixedSums[ia], &b = fixedSums[ib];
+        const fixedCell &c = fixedSums[ic], &d = fixedSums[id];
+        hueX = (d.hueX - b.hueX - c.hueX + a.hueX) / hueScale;
+        hueY = (d.hueY - b.hueY - c.hueY + a.hueY) / hueScale;
+        sat = (d.sat - b.sat - c.sat + a.sat) / slScale;
+        lum = (d.lum - b.lum - c.lum + a.lum) / slScale;
     }
 
     hueX /= rectArea(ul, lr);
@@ -131,55 +342,350 @@ HSLAPixel stats::getAvg(pair<int, int> ul, pair<int, int> lr) {
     return HSLAPixel(hue, sat, lum, 1.0);
 }
 
-double stats::entropy(pair<int, int> ul, pair<int, int> lr) {
+template <int BINS>
+double binnedStats<BINS>::entropy(pair<int, int> ul, pair<int, int> lr) {
     int x0 = ul.first, y0 = ul.second;
     int x1 = lr.first, y1 = lr.second;
-    long area = rectArea(ul, lr);
-    double entropy = 0.0;
-
-    vector<int> distn(36, 0);
-    if (x0 > 0 && y0 > 0) {
-        // not at edge
-        transform(distn.begin(), distn.end(), hist[x1][y1].begin(),
-                  distn.begin(), plus<int>());
-        transform(distn.begin(), distn.end(), hist[x1][y0 - 1].begin(),
-                  distn.begin(), minus<int>());
-        transform(distn.begin(), distn.end(), hist[x0 - 1][y1].begin(),
-                  distn.begin(), minus<int>());
-        transform(distn.begin(), distn.end(), hist[x0 - 1][y0 - 1].begin(),
-                  distn.begin(), plus<int>());
-    } else if (x0 == 0 && y0 > 0) {
-        // at left edge
-        transform(distn.begin(), distn.end(), hist[x1][y1].begin(),
-                  distn.begin(), plus<int>());
-        transform(distn.begin(), distn.end(), hist[x1][y0 - 1].begin(),
-                  distn.begin(), minus<int>());
-    } else if (x0 > 0 && y0 == 0) {
-        // at upper edge
-        transform(distn.begin(), distn.end(), hist[x1][y1].begin(),
-                  distn.begin(), plus<int>());
-        transform(distn.begin(), distn.end(), hist[x0 - 1][y1].begin(),
-                  distn.begin(), minus<int>());
-    } else {
-        // at upper-left corner
-        transform(distn.begin(), distn.end(), hist[x1][y1].begin(),
-                  distn.begin(), plus<int>());
-    }
+    histCorner corners[4] = {histAt(x1 + 1, y1 + 1), histAt(x1 + 1, y0),
+                             histAt(x0, y1 + 1), histAt(x0, y0)};
+    return cornerEntropy<BINS>(corners, rectArea(ul, lr), nlogn);
+}
 
-    for (int i = 0; i < 36; i++) {
-        if (distn[i] > 0) {
-            entropy += ((double)distn[i] / (double)area) *
-                       log2((double)distn[i] / (double)area);
-        }
-    }
-    return -1 * entropy;
+template <int BINS>
+void binnedStats<BINS>::histDiff(int xa, int ya, int xb, int yb,
+                                 int32_t *counts) {
+    cornerDiff<BINS>(histAt(xa, ya), histAt(xb, yb), counts);
+}
+
+template <int BINS>
+double binnedStats<BINS>::countsEntropy(const int32_t *counts, long area) {
+    return countEntropy<BINS>(counts, area, nlogn);
 }
 
-double stats::weightedSumEntropy(pair<int, int> ulul, pair<int, int> ullr,
-                                 pair<int, int> lrul, pair<int, int> lrlr) {
+template <int BINS>
+double binnedStats<BINS>::weightedSumEntropy(pair<int, int> ulul,
+                                             pair<int, int> ullr,
+                                             pair<int, int> lrul,
+                                             pair<int, int> lrlr) {
     long area = rectArea(ulul, lrlr);
     long ulArea = rectArea(ulul, ullr);
     long lrArea = rectArea(lrul, lrlr);
     return (entropy(ulul, ullr) * ulArea / area) +
            (entropy(lrul, lrlr) * lrArea / area);
 }
+
+template <int BINS>
+long binnedStats<BINS>::splitProfile(pair<int, int> ul, pair<int, int> lr,
+                                     bool vert, double *out, double bound) {
+    int lo = vert ? ul.first : ul.second;
+    int hi = vert ? lr.first : lr.second;
+    return splitProfile(ul, lr, vert, out, bound, lo, hi);
+}
+
+template <int BINS>
+long binnedStats<BINS>::splitProfile(pair<int, int> ul, pair<int, int> lr,
+                                     bool vert, double *out, double bound,
+                                     int first, int last) {
+    int x0 = ul.first, y0 = ul.second;
+    int x1 = lr.first, y1 = lr.second;
+    long area = rectArea(ul, lr);
+    // first split line, and the pixels gained per step
+    int lo = vert ? x0 : y0;
+    long stripArea = vert ? (y1 - y0 + 1) : (x1 - x0 + 1);
+
+    // band(i) is the histogram of everything in the rectangle's rows
+    // (vert) or columns before line i, so strip i is band(i+1) - band(i)
+    // and LT is band(first) - band(lo) before the first strip
+    alignas(32) int32_t prev[BINS], next[BINS], total[BINS];
+    alignas(32) int32_t left[BINS], right[BINS];
+    if (vert) {
+        histDiff(x0, y1 + 1, x0, y0, left);
+        histDiff(first, y1 + 1, first, y0, prev);
+        histDiff(x1 + 1, y1 + 1, x1 + 1, y0, total);
+    } else {
+        histDiff(x1 + 1, y0, x0, y0, left);
+        histDiff(x1 + 1, first, x0, first, prev);
+        histDiff(x1 + 1, y1 + 1, x0, y1 + 1, total);
+    }
+
+    // the margin keeps lines tied with the lowest value
+    const double MARGIN = 1e-9;
+    bool bounded = (bound < HUGE_VAL);
+    double parentEntropy = 0.0;
+    if (bounded) {
+        for (int k = 0; k < BINS; k++) {
+            right[k] = total[k] - left[k];
+        }
+        parentEntropy = countsEntropy(right, area);
+    }
+    for (int k = 0; k < BINS; k++) {
+        left[k] = prev[k] - left[k];
+    }
+
+    long evaluated = 0;
+    for (int i = first; i < last; i++) {
+        if (vert) {
+            histDiff(i + 1, y1 + 1, i + 1, y0, next);
+        } else {
+            histDiff(x1 + 1, i + 1, x0, i + 1, next);
+        }
+        for (int k = 0; k < BINS; k++) {
+            left[k] += next[k] - prev[k];
+            right[k] = total[k] - next[k];
+            prev[k] = next[k];
+        }
+        long ltArea = (i - lo + 1) * stripArea;
+        long rbArea = area - ltArea;
+        if (bounded) {
+            double w = (double)ltArea / area;
+            double mixing = -w * log2(w) - (1.0 - w) * log2(1.0 - w);
+            if (parentEntropy - mixing > bound + MARGIN) {
+                out[i - lo] = HUGE_VAL;
+                continue;
+            }
+        }
+        out[i - lo] = (countsEntropy(left, ltArea) * ltArea / area) +
+                      (countsEntropy(right, rbArea) * rbArea / area);
+        bound = min(bound, out[i - lo]);
+        evaluated++;
+    }
+    return evaluated;
+}
+
+template <int BINS>
+string binnedStats<BINS>::cacheName(const imageKey &key, satMode mode) {
+    ostringstream name;
+    name << "stats-" << hex << key.hash << dec << "-" << key.width << "x"
+         << key.height << "-" << BINS << "bins-" << modeName(mode) << ".bin";
+    return name.str();
+}
+
+template <int BINS>
+bool binnedStats<BINS>::writeToFile(const string &fileName,
+                                    const imageKey &key) const {
+    const char *tables[CACHE_TABLES] = {(const char *)sums.data(),
+                                        (const char *)fixedSums.data(),
+                                        (const char *)histAbove.data(),
+                                        (const char *)histLeft.data(),
+                                        (const char *)histRows.data(),
+                                        (const char *)histCols.data(),
+                                        (const char *)histLocal.data()};
+    cacheHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, CACHE_MAGIC, sizeof(h.magic));
+    h.version = CACHE_VERSION;
+    h.byteOrder = CACHE_BYTE_ORDER;
+    h.hash = key.hash;
+    h.width = key.width;
+    h.height = key.height;
+    h.bins = BINS;
+    h.tile = HIST_TILE;
+    h.superTile = HIST_SUPER;
+    h.mode = mode;
+    h.hueScale = hueScale;
+    h.slScale = slScale;
+    h.bytes[0] = sums.size() * sizeof(sumCell);
+    h.bytes[1] = fixedSums.size() * sizeof(fixedCell);
+    h.bytes[2] = histAbove.size() * sizeof(uint32_t);
+    h.bytes[3] = histLeft.size() * sizeof(uint32_t);
+    h.bytes[4] = histRows.size() * sizeof(uint16_t);
+    h.bytes[5] = histCols.size() * sizeof(uint16_t);
+    h.bytes[6] = histLocal.size() * sizeof(uint8_t);
+    uint64_t end = alignUp(sizeof(h));
+    for (int i = 0; i < CACHE_TABLES; i++) {
+        h.offset[i] = end;
+        end = alignUp(end + h.bytes[i]);
+    }
+
+    // write next to the final name and rename, which is atomic
+    ostringstream tmpName;
+    tmpName << fileName << ".tmp" << getpid();
+    ofstream out(tmpName.str().c_str(), ios::binary | ios::trunc);
+    out.write((const char *)&h, sizeof(h));
+    const char zeros[CACHE_ALIGN] = {0};
+    uint64_t pos = sizeof(h);
+    for (int i = 0; i < CACHE_TABLES; i++) {
+        out.write(zeros, h.offset[i] - pos);
+        out.write(tables[i], h.bytes[i]);
+        pos = h.offset[i] + h.bytes[i];
+    }
+    out.write(zeros, end - pos);
+    out.close();
+    if (!out || rename(tmpName.str().c_str(), fileName.c_str()) != 0) {
+        remove(tmpName.str().c_str());
+        return false;
+    }
+    return true;
+}
+
+template <int BINS>
+bool binnedStats<BINS>::readFromFile(const string &fileName,
+                                     const imageKey &key, satMode mode) {
+    shared_ptr<mappedFile> file = mappedFile::open(fileName);
+    if (!file || file->size() < sizeof(cacheHeader)) {
+        return false;
+    }
+    cacheHeader h;
+    memcpy(&h, file->data(), sizeof(h));
+    if (memcmp(h.magic, CACHE_MAGIC, sizeof(h.magic)) != 0 ||
+        h.version != CACHE_VERSION || h.byteOrder != CACHE_BYTE_ORDER ||
+        h.hash != key.hash || h.width != key.width ||
+        h.height != key.height || h.bins != BINS || h.tile != HIST_TILE ||
+        h.superTile != HIST_SUPER || h.mode != (uint32_t)mode) {
+        return false;
+    }
+
+    // every table must have exactly the size the constructor gives it
+    uint64_t w = h.width, ht = h.height;
+    uint64_t corners = (w + 1) * (ht + 1);
+    uint64_t expected[CACHE_TABLES] = {
+        (mode == SAT_DOUBLE) ? corners * sizeof(sumCell) : 0,
+        (mode == SAT_DOUBLE) ? 0 : corners * sizeof(fixedCell),
+        (ht / HIST_SUPER + 1) * (w + 1) * BINS * sizeof(uint32_t),
+        (ht + 1) * (w / HIST_SUPER + 1) * BINS * sizeof(uint32_t),
+        (ht / HIST_TILE + 1) * (w + 1) * BINS * sizeof(uint16_t),
+        (ht + 1) * (w / HIST_TILE + 1) * BINS * sizeof(uint16_t),
+        (ht - ht / HIST_TILE + 1) * (w - w / HIST_TILE + 1) * BINS *
+            sizeof(uint8_t)};
+    for (int i = 0; i < CACHE_TABLES; i++) {
+        if (h.bytes[i] != expected[i] || h.offset[i] % CACHE_ALIGN != 0 ||
+            h.offset[i] + h.bytes[i] > file->size()) {
+            return false;
+        }
+    }
+
+    char *base = file->data();
+    this->mode = mode;
+    hueScale = h.hueScale;
+    slScale = h.slScale;
+    stride = w + 1;
+    tileStride = w / HIST_TILE + 1;
+    superStride = w / HIST_SUPER + 1;
+    localStride = w - w / HIST_TILE + 1;
+    sums.view((sumCell *)(base + h.offset[0]), h.bytes[0] / sizeof(sumCell));
+    fixedSums.view((fixedCell *)(base + h.offset[1]),
+                   h.bytes[1] / sizeof(fixedCell));
+    histAbove.view((uint32_t *)(base + h.offset[2]),
+                   h.bytes[2] / sizeof(uint32_t));
+    histLeft.view((uint32_t *)(base + h.offset[3]),
+                  h.bytes[3] / sizeof(uint32_t));
+    histRows.view((uint16_t *)(base + h.offset[4]),
+                  h.bytes[4] / sizeof(uint16_t));
+    histCols.view((uint16_t *)(base + h.offset[5]),
+                  h.bytes[5] / sizeof(uint16_t));
+    histLocal.view((uint8_t *)(base + h.offset[6]), h.bytes[6]);
+    moments = flatTable<momentCell>();
+    nlogn = nlognTable((long)w * ht);
+    mapping = file;
+    return true;
+}
+
+template <int BINS>
+void binnedStats<BINS>::buildMoments(PNG &im, int threads) {
+    if (!moments.empty()) {
+        return;
+    }
+    moments.assign(stride * (im.height() + 1), momentCell());
+    prefixSums(moments, im, threads, [](const HSLAPixel *p) {
+        double sl = p->s * p->l;
+        double x = cos(p->h * PI / 180) * sl;
+        double y = sin(p->h * PI / 180) * sl;
+        momentCell c = {x, y, p->l, x * x + y * y + p->l * p->l};
+        return c;
+    });
+}
+
+template <int BINS>
+double binnedStats<BINS>::sse(pair<int, int> ul, pair<int, int> lr) {
+    int x0 = ul.first, y0 = ul.second;
+    int x1 = lr.first, y1 = lr.second;
+    const momentCell &a = moments[y0 * stride + x0];
+    const momentCell &b = moments[y0 * stride + x1 + 1];
+    const momentCell &c = moments[(y1 + 1) * stride + x0];
+    const momentCell &d = moments[(y1 + 1) * stride + x1 + 1];
+
+    double x = d.coneX - b.coneX - c.coneX + a.coneX;
+    double y = d.coneY - b.coneY - c.coneY + a.coneY;
+    double l = d.lum - b.lum - c.lum + a.lum;
+    double sq = d.sq - b.sq - c.sq + a.sq;
+    // rounding can leave a tiny negative sum for a uniform rectangle
+    return max(0.0, sq - (x * x + y * y + l * l) / rectArea(ul, lr));
+}
+
+template <int BINS>
+double binnedStats<BINS>::distSum(pair<int, int> ul, pair<int, int> lr,
+                                  const HSLAPixel &color) {
+    int x0 = ul.first, y0 = ul.second;
+    int x1 = lr.first, y1 = lr.second;
+    const momentCell &a = moments[y0 * stride + x0];
+    const momentCell &b = moments[y0 * stride + x1 + 1];
+    const momentCell &c = moments[(y1 + 1) * stride + x0];
+    const momentCell &d = moments[(y1 + 1) * stride + x1 + 1];
+
+    double x = d.coneX - b.coneX - c.coneX + a.coneX;
+    double y = d.coneY - b.coneY - c.coneY + a.coneY;
+    double l = d.lum - b.lum - c.lum + a.lum;
+    double sq = d.sq - b.sq - c.sq + a.sq;
+    double sl = color.s * color.l;
+    double cx = cos(color.h * PI / 180) * sl;
+    double cy = sin(color.h * PI / 180) * sl;
+    double cl = color.l;
+    double norm = cx * cx + cy * cy + cl * cl;
+    return max(0.0, sq - 2 * (cx * x + cy * y + cl * l) +
+                        rectArea(ul, lr) * norm);
+}
+
+template <int BINS>
+double binnedStats<BINS>::distSumError(pair<int, int> ul, pair<int, int> lr,
+                                       const HSLAPixel &color) {
+    int x0 = ul.first, y0 = ul.second;
+    int x1 = lr.first, y1 = lr.second;
+    const momentCell &a = moments[y0 * stride + x0];
+    const momentCell &b = moments[y0 * stride + x1 + 1];
+    const momentCell &c = moments[(y1 + 1) * stride + x0];
+    const momentCell &d = moments[(y1 + 1) * stride + x1 + 1];
+
+    // a corner's sums took at most x1 + y1 + 2 additions, each rounding
+    // by half an epsilon of the sum so far; sq and lum only add values
+    // of one sign, and a cone coordinate is at most lum in size, so the
+    // corner values bound every sum so far. The rest covers the
+    // coordinates of each pixel and the arithmetic of distSum, and
+    // epsilon rather than half of it leaves a factor of two to spare.
+    double steps = x1 + y1 + 12.0;
+    double sl = color.s * color.l;
+    double weight = fabs(cos(color.h * PI / 180) * sl) +
+                    fabs(sin(color.h * PI / 180) * sl) + color.l;
+    double sq = a.sq + b.sq + c.sq + d.sq;
+    double lum = a.lum + b.lum + c.lum + d.lum;
+    return numeric_limits<double>::epsilon() * steps *
+           (sq + 2 * weight * lum + rectArea(ul, lr) * weight * weight);
+}
+
+template <int BINS>
+double binnedStats<BINS>::leafError() {
+    // the error of a channel: half a step of an integer mode, or for
+    // SAT_DOUBLE the rounding of the four corners of the pixel, each a
+    // sum of at most width * height values of at most 1 that rounded
+    // once per row and column before it (with a factor of two to spare)
+    double hueStep = 0.5 / hueScale;
+    double slStep = 0.5 / slScale;
+    if (mode == SAT_DOUBLE) {
+        double w = stride - 1;
+        double h = sums.size() / stride - 1.0;
+        hueStep = 4 * numeric_limits<double>::epsilon() * (w + h + 4) * w * h;
+        slStep = hueStep;
+    }
+    // s and l are off by a step each; the hue direction is that of
+    // (cos, sin) off by a step in either coordinate, at most twice that
+    // many radians away
+    double sl = slStep;
+    double hue = 2 * sqrt(2.0) * hueStep;
+    // s l cos(h), s l sin(h) move by the change of s l plus the turn of
+    // a radius of at most 1; l by its own step
+    return (2 * sl + sl * sl) + hue + sl;
+}
+
+// the bin counts the library is built for
+template class binnedStats<16>;
+template class binnedStats<36>;
+template class binnedStats<72>;
@@ -3,9 +3,16 @@
 
 #include "cs221util/HSLAPixel.h"
 #include "cs221util/PNG.h"
+#include "entropyKernel.h"
+#include "flatTable.h"
+#include "mappedFile.h"
+#include "parallel.h"
 
 #include <algorithm>
 #include <cmath>
+#include <cstdint>
+#include <memory>
+#include <string>
 #include <utility>
 #include <vector>
 
@@ -14,7 +21,41 @@ using namespace cs221util;
 
 #define PI 3.14159265
 
-class stats {
+/**
+ * How stats accumulates the color channels of its summed-area table.
+ */
+enum satMode {
+    SAT_DOUBLE,  // double sums; rounding grows with distance from (0,0)
+    SAT_FIXED64, // 64-bit fixed point with 32 fraction bits, exact sums
+    SAT_QUANT8   // channels rounded to 8 bits first, exact integer sums
+};
+
+/**
+ * Identifies the image a stats cache file belongs to: its hash
+ * (PNG::computeHash) and dimensions. Hashing visits every pixel, so
+ * compute the key once and pass it to each cache call; a PNG converts
+ * to its key where one is expected.
+ */
+struct imageKey {
+    imageKey(const PNG &im);
+
+    uint64_t hash;
+    uint32_t width;
+    uint32_t height;
+};
+
+/**
+ * binnedStats: summed-area tables over an image, answering the average
+ * color and the hue entropy of any rectangle in constant time. Hues are
+ * counted in BINS bins of BIN_WIDTH degrees each; BINS must be a
+ * multiple of 4, and the library is built for 16, 36 and 72 bins. Fewer
+ * bins make the tables smaller and entropy() cheaper, more bins tell
+ * apart subtler hue gradients.
+ */
+template <int BINS>
+class binnedStats {
+    static_assert(BINS > 0 && BINS % 4 == 0, "unsupported bin count");
+
 
     // private:
 public:
@@ -31,53 +72,234 @@ public:
      */
 
     /**
-     * sumHueX[i][j] contains the cumulative sum of the X component of the
-     * hue, as described above. The sum is taken over all pixels in the
-     * range (0,0) to (i,j). (you may decide to use (0,0) to (j,i), if you
-     * prefer.) This table can be built in time proportional to the size of
-     * the table itself (constant per cell), and it's up to you to figure out
-     * how to do it.
-     **/
-    vector<vector<double>> sumHueX;
+     * One cell of the summed-area table. The four channels are stored
+     * together so that a corner fetch touches a single 32-byte block,
+     * which never straddles a cache line in a 64-byte aligned table.
+     */
+    struct sumCell {
+        double hueX;
+        double hueY;
+        double sat;
+        double lum;
+
+        void add(const sumCell &o) {
+            hueX += o.hueX;
+            hueY += o.hueY;
+            sat += o.sat;
+            lum += o.lum;
+        }
+    };
 
     /**
-     * sumHueY[i][j] contains the cumulative sum of the Y component of the
-     * hue, as described above. The sum is taken over all pixels in the
-     * range (0,0) to (i,j). (you may decide to use (0,0) to (j,i), if you
-     * prefer.) This table can be built in time proportional to the size of
-     * the table itself (constant per cell), and it's up to you to figure out
-     * how to do it.
+     * A cell of the integer summed-area table used by SAT_FIXED64 and
+     * SAT_QUANT8. Every channel holds its value times hueScale (hueX,
+     * hueY) or slScale (sat, lum), rounded once per pixel, so every
+     * rectangle sum is exact no matter where the rectangle lies.
      */
-    vector<vector<double>> sumHueY;
+    struct fixedCell {
+        int64_t hueX;
+        int64_t hueY;
+        int64_t sat;
+        int64_t lum;
+
+        void add(const fixedCell &o) {
+            hueX += o.hueX;
+            hueY += o.hueY;
+            sat += o.sat;
+            lum += o.lum;
+        }
+    };
 
     /**
-     * sumSat[i][j] contains the cumulative sum of the saturation component
-     * of the pixel (the s in HSLA). The sum is taken over all pixels in the
-     * range (0,0) to (i,j). (you may decide to use (0,0) to (j,i), if you
-     * prefer.) This table can be built in time proportional to the size of
-     * the table itself (constant per cell), and it's up to you to figure out
-     * how to do it.
+     * sums holds the cumulative sums of hueX, hueY, saturation and
+     * luminance in one row-major, zero-padded table of
+     * (width+1) x (height+1) cells. The cell for corner (x,y), at
+     * sums[y * stride + x], contains the sums over all pixels in the
+     * range (0,0) to (x-1,y-1). The extra row and column of zeros mean a
+     * rectangle sum is always the same four-corner expression, without
+     * special cases along the top and left edges of the image.
      */
-    vector<vector<double>> sumSat;
+    flatTable<sumCell> sums;
 
     /**
-     * sumLum[i][j] contains the cumulative sum of the luminance component
-     * of the pixel (the l in HSLA). The sum is taken over all pixels in the
-     * range (0,0) to (i,j). (you may decide to use (0,0) to (j,i), if you
-     * prefer.) This table can be built in time proportional to the size of
-     * the table itself (constant per cell), and it's up to you to figure out
-     * how to do it.
+     * The same table in integer form, laid out like sums. Only the one
+     * matching mode is filled; the other stays empty.
      */
-    vector<vector<double>> sumLum;
+    flatTable<fixedCell> fixedSums;
 
     /**
-     * hist[i][j][k]: hist[i][j] contains a histogram of the hue values
-     * 0 to 360 into bins of width 10, over the pixels in the rectangle
-     * defined by (0,0) through (i,j). Thus, hist[i][j][k] contains
-     * the number of pixels whose hue value h, is: k*10 <= h < (k+1)*10
-     * over the rectangle.
+     * A cell of the moment table: sums of the coordinates of the pixels
+     * in the color cone HSLAPixel::dist measures in, (s l cos(h),
+     * s l sin(h), l), and of their squared lengths.
      */
-    vector<vector<vector<int>>> hist;
+    struct momentCell {
+        double coneX;
+        double coneY;
+        double lum;
+        double sq;
+
+        void add(const momentCell &o) {
+            coneX += o.coneX;
+            coneY += o.coneY;
+            lum += o.lum;
+            sq += o.sq;
+        }
+    };
+
+    /**
+     * The moment table, laid out like sums. It is only built on request
+     * (see buildMoments), for costs that need it such as varianceCost.
+     */
+    flatTable<momentCell> moments;
+
+    /**
+     * Channel accumulation in use, and for the integer modes the factors
+     * by which the hue coordinates and the saturation and luminance are
+     * scaled before rounding.
+     */
+    satMode mode;
+    double hueScale;
+    double slScale;
+
+    /**
+     * Number of cells per row of sums, i.e. the image width plus one.
+     */
+    size_t stride;
+
+    /**
+     * The hue histogram integral: H(x,y)[k] is the number of pixels in
+     * the range (0,0) to (x-1,y-1) whose hue value h is
+     * k*BIN_WIDTH <= h < (k+1)*BIN_WIDTH. Corners use the same padded
+     * (x,y) convention as sums, so x is in [0, width] and y is in
+     * [0, height].
+     *
+     * Storing all bins as ints at every corner costs 4*BINS bytes per
+     * pixel, so the integral is split over HIST_TILE x HIST_TILE tiles
+     * grouped into HIST_SUPER x HIST_SUPER super tiles. For a corner
+     * (x,y) in the tile whose upper left corner is (x0,y0), inside the
+     * super tile whose upper left corner is (X0,Y0):
+     *
+     *   H(x,y) = histAbove(x, Y0)  pixels above the super tile row
+     *          + histLeft(X0, y)   pixels left of the super tile, in its row
+     *          + histRows(x, y0)   pixels above the tile row, from (X0,Y0)
+     *          + histCols(x0, y)   pixels left of the tile, from X0
+     *          + histLocal(x, y)   pixels inside the tile, from (x0,y0)
+     *
+     * Only the two 32-bit tables count from the image edge, and they are
+     * stored along super tile boundaries alone. The tile-relative parts
+     * are at most 255*240, 240*15 and 15*15, so histRows and histCols fit
+     * in 16 bits and histLocal in a byte; even their sum fits in 16 bits.
+     * histLocal leaves out the tile borders, where it is zero. In total
+     * this is about 1.16*BINS bytes per pixel: 42 for 36 bins, against
+     * the 184 of 36-int vectors per pixel (144 bytes of ints, plus the
+     * vector and its allocation).
+     */
+    static const int HIST_BINS = BINS;
+    static constexpr double BIN_WIDTH = 360.0 / BINS;
+    static const int HIST_TILE = 16;
+    static const int HIST_SUPER = 256;
+
+    /**
+     * histAbove[(sy * stride + x) * HIST_BINS + k] is H(x, sy*HIST_SUPER)[k]
+     * for every super tile row boundary sy in [0, height/HIST_SUPER].
+     */
+    flatTable<uint32_t> histAbove;
+
+    /**
+     * histLeft[(y * superStride + sx) * HIST_BINS + k] is the number of
+     * pixels in bin k left of X0 = sx*HIST_SUPER and between the top of
+     * y's super tile row and y-1, for every super tile column boundary
+     * sx in [0, width/HIST_SUPER].
+     */
+    flatTable<uint32_t> histLeft;
+
+    /**
+     * histRows[(ty * stride + x) * HIST_BINS + k] is the number of pixels
+     * in bin k in the range (X0,Y0) to (x-1, ty*HIST_TILE-1) of the super
+     * tile holding corner (x, ty*HIST_TILE), for every tile row boundary
+     * ty in [0, height/HIST_TILE]. It is zero along super tile rows.
+     */
+    flatTable<uint16_t> histRows;
+
+    /**
+     * histCols[(y * tileStride + tx) * HIST_BINS + k] is the number of
+     * pixels in bin k right of X0 and left of x0 = tx*HIST_TILE, between
+     * the top of y's tile row and y-1, for every tile column boundary tx
+     * in [0, width/HIST_TILE].
+     */
+    flatTable<uint16_t> histCols;
+
+    /**
+     * histLocal[(ly * localStride + lx) * HIST_BINS + k] is the number of
+     * pixels in bin k in the range (x0,y0) to (x-1,y-1) of the tile
+     * holding corner (x,y), where lx = x - x/HIST_TILE and
+     * ly = y - y/HIST_TILE. The count is zero along the top row and left
+     * column of every tile, so these corners have no cells of their own
+     * and all read row 0 or column 0, which hold zeros.
+     */
+    flatTable<uint8_t> histLocal;
+
+    /**
+     * Number of tile column boundaries per row of histCols.
+     */
+    size_t tileStride;
+
+    /**
+     * Number of super tile column boundaries per row of histLeft.
+     */
+    size_t superStride;
+
+    /**
+     * Number of cells per row of histLocal: the corners inside tiles and
+     * the zero column.
+     */
+    size_t localStride;
+
+    /**
+     * n log2(n) for the pixel counts entropy() sees, which are bounded
+     * by the image area.
+     */
+    nlognTable nlogn;
+
+    /**
+     * The cache file the tables are viewed from, if they were read with
+     * readFromFile; NULL when the tables own their cells.
+     */
+    shared_ptr<mappedFile> mapping;
+
+    /**
+     * Returns pointers to the five parts of H(x,y).
+     */
+    histCorner histAt(int x, int y);
+
+    /**
+     * Fills the channel sums, as a prefix pass along every pixel row
+     * followed by one down every column of corners.
+     */
+    void buildSums(PNG &im, int threads);
+
+    /**
+     * The two prefix passes of buildSums over table, with cell(p)
+     * giving the cell value of a single pixel p.
+     */
+    template <class Cell, class CellOf>
+    void prefixSums(flatTable<Cell> &table, PNG &im, int threads,
+                    CellOf cell);
+
+    /**
+     * Fills the hue histogram integral: each tile row on its own, then
+     * prefix passes of histLeft and histRows down the tile rows of every
+     * super tile row, which also carry histAbove from one super tile row
+     * to the next.
+     */
+    void buildHist(PNG &im, int threads);
+
+    /**
+     * Fills corner row y+1 of histCols and histLocal from pixel row y,
+     * and of histLeft counting from the top of the tile row only, and
+     * adds the row into the counts of its tile row in histRows.
+     */
+    void histRow(PNG &im, unsigned y);
 
 public:
     /**
@@ -88,8 +310,62 @@ public:
      * Note that the hue (h) value of each pixel is represented by
      * its cartesian coordinates: X = cos(h) and Y = sin(h).
      * This is done to simplify distance and average computation.
+     *
+     * Both the sums and the histogram are built as a pass along the rows
+     * and a pass down the columns, each split across threads. Every
+     * entry is computed by the same additions in the same order whatever
+     * the thread count, so the tables do not depend on it.
+     *
+     * @param threads number of threads to build with; 0 uses every
+     * hardware thread
+     * @param mode how the color channels are accumulated. The integer
+     * modes make getAvg reproducible at any image size and position;
+     * SAT_QUANT8 first rounds each channel to one of 256 levels.
+     */
+    binnedStats(PNG &im, int threads = 0, satMode mode = SAT_DOUBLE);
+
+    /**
+     * Creates empty tables, to be filled by readFromFile.
+     */
+    binnedStats();
+
+    /**
+     * Returns a file name for the tables of an image built in the given
+     * mode, made of the image key, the bin count and the mode. Tables
+     * for different images or settings never share a name.
+     */
+    static string cacheName(const imageKey &key, satMode mode = SAT_DOUBLE);
+
+    /**
+     * Writes the tables to a versioned binary file, tagged with the key
+     * of the image they were built from. The file is written under a
+     * temporary name and renamed into place, so readers never see a
+     * partial file.
+     *
+     * @param fileName Name of the file to be written.
+     * @param key the image the tables were built from.
+     * @return true, if the tables were successfully written.
+     */
+    bool writeToFile(const string &fileName, const imageKey &key) const;
+
+    /**
+     * Replaces the tables with those stored in a file by writeToFile. The
+     * file is memory-mapped and the tables are used in place, without
+     * parsing or copying, so reopening costs little more than the page
+     * faults of the cells later queries touch. Processes reading the
+     * same file share its pages.
+     *
+     * The file is rejected, leaving the tables unchanged, if its version
+     * differs from this build's, or if it was written for another image,
+     * bin count or mode.
+     *
+     * @param fileName Name of the file to be read from.
+     * @param key the image the tables are wanted for.
+     * @param mode the accumulation mode the tables are wanted in.
+     * @return true, if the tables were successfully read.
      */
-    stats(PNG &im);
+    bool readFromFile(const string &fileName, const imageKey &key,
+                      satMode mode = SAT_DOUBLE);
 
     /**
      * given a rectangle, return the number of pixels in the rectangle
@@ -122,9 +398,28 @@ public:
      * follows: E = -Sum(p_i log(p_i)), where p_i is the fraction of
      * pixels in bin i, and the sum is taken over all the bins.
      * bins holding no pixels should not be included in the sum.
+     * The sum is evaluated by the fastest kernel in entropyKernel.h, as
+     * (area log2(area) - Sum(c_i log2(c_i))) / area over the bin counts
+     * c_i, using the nlogn table.
      */
     double entropy(pair<int, int> ul, pair<int, int> lr);
 
+    /**
+     * Fills counts[0..BINS-1] with the hue histogram difference
+     * H(xa,ya) - H(xb,yb) of two corners of the integral (see histRows).
+     * For two corners in the same column this is the histogram of a band
+     * of rows left of that column; for two corners in the same row, of a
+     * band of columns above it. counts must be 16-byte aligned.
+     */
+    void histDiff(int xa, int ya, int xb, int yb, int32_t *counts);
+
+    /**
+     * Returns the entropy of a BINS-bin histogram holding area pixels,
+     * exactly as entropy() would for a rectangle with those counts.
+     * counts must be 16-byte aligned.
+     */
+    double countsEntropy(const int32_t *counts, long area);
+
     /**
      * given two rectangles, return the weighted sum entropy of them.
      *
@@ -138,6 +433,102 @@ public:
      */
     double weightedSumEntropy(pair<int, int> ulul, pair<int, int> ullr,
                               pair<int, int> lrul, pair<int, int> lrlr);
+
+    /**
+     * Fills out[j] with the weighted sum entropy of splitting the
+     * rectangle after column (vert) or row lo + j, for every line
+     * between ul and lr: the rectangle's width - 1 or height - 1 values,
+     * each exactly what weightedSumEntropy returns for that split.
+     * Neighbouring lines share their histogram corners, so the profile
+     * costs one corner difference and two countsEntropy calls per line.
+     *
+     * Given a finite bound, lines whose weighted entropy provably
+     * exceeds both bound and every value so far are not evaluated and
+     * get HUGE_VAL. The proof is the mixing bound H(rect) - h(w), h
+     * being the binary entropy of the LT weight w. Ties with the lowest
+     * value are always evaluated.
+     *
+     * @param ul is (x,y) of the upper left corner of the rectangle
+     * @param lr is (x,y) of the lower right corner of the rectangle
+     * @param vert true for vertical split lines, false for horizontal
+     * @param out room for one value per line
+     * @param bound a weighted entropy some line is known to reach
+     * @return the number of lines evaluated
+     */
+    long splitProfile(pair<int, int> ul, pair<int, int> lr, bool vert,
+                      double *out, double bound = HUGE_VAL);
+
+    /**
+     * splitProfile for the lines first .. last-1 only, still written to
+     * out[line - lo], lo being the rectangle's first line. Profiles of
+     * disjoint ranges can be filled at the same time.
+     */
+    long splitProfile(pair<int, int> ul, pair<int, int> lr, bool vert,
+                      double *out, double bound, int first, int last);
+
+    /**
+     * Builds the moment table for im, the image the tables were built
+     * from, unless it exists already. sse() needs it.
+     *
+     * @param threads number of threads to build with; 0 uses every
+     * hardware thread
+     */
+    void buildMoments(PNG &im, int threads = 0);
+
+    /**
+     * given a rectangle, return the sum of the squared distances
+     * (HSLAPixel::dist) of its pixels to their mean color in the color
+     * cone, as Sum(|v|^2) - |Sum(v)|^2 / area over the cone points v.
+     * Takes a handful of operations whatever the size of the rectangle;
+     * the moment table must have been built.
+     *
+     * @param ul is (x,y) of the upper left corner of the rectangle
+     * @param lr is (x,y) of the lower right corner of the rectangle
+     */
+    double sse(pair<int, int> ul, pair<int, int> lr);
+
+    /**
+     * given a rectangle and a color, return the sum of the squared
+     * distances (HSLAPixel::dist) of its pixels to that color, as
+     * Sum(|v|^2) - 2 c.Sum(v) + area |c|^2 over the cone points v. The
+     * largest distance is between this sum / area and the sum itself,
+     * up to the rounding of the moment table; the moment table must have
+     * been built.
+     *
+     * @param ul is (x,y) of the upper left corner of the rectangle
+     * @param lr is (x,y) of the lower right corner of the rectangle
+     * @param color the color measured from
+     */
+    double distSum(pair<int, int> ul, pair<int, int> lr,
+                   const HSLAPixel &color);
+
+    /**
+     * given the same arguments, return a bound on how far distSum may
+     * lie from the exact sum over the pixels' cone points. The sums of a
+     * corner of the moment table round once per row and column before
+     * it, so the bound grows with the corner's distance from (0,0) and
+     * with the sums there, not with the size of the image.
+     *
+     * @param ul is (x,y) of the upper left corner of the rectangle
+     * @param lr is (x,y) of the lower right corner of the rectangle
+     * @param color the color measured from
+     */
+    double distSumError(pair<int, int> ul, pair<int, int> lr,
+                        const HSLAPixel &color);
+
+    /**
+     * return how far, in the color cone HSLAPixel::dist measures in, the
+     * average of a single pixel (getAvg of a 1x1 rectangle) may lie from
+     * the pixel itself, the point of the moment table. The integer modes
+     * round every channel of every pixel; SAT_DOUBLE only rounds the
+     * four corner sums, by an amount that grows with the image.
+     */
+    double leafError();
 };
 
+/**
+ * The tables described in the spec: 36 hue bins of 10 degrees.
+ */
+typedef binnedStats<36> stats;
+
 #endif
@@ -1,12 +1,16 @@
 #define CATCH_CONFIG_MAIN
+#include "allocCounter.h"
 #include "cs221util/HSLAPixel.h"
 #include "cs221util/PNG.h"
 #include "cs221util/catch.hpp"
 #include "stats.h"
 #include "twoDtree.h"
 
+#include <algorithm>
+#include <cstring>
 #include <iostream>
 #include <sys/stat.h>
+#include <type_traits>
 #include <vector>
 
 using namespace std;
@@ -25,6 +29,14 @@ TEST_CASE("stats::basic rectArea", "[weight=1][part=stats]") {
     REQUIRE(result == 4);
 }
 
+TEST_CASE("stats::rectArea past 2^31 pixels", "[weight=1][part=stats]") {
+    // only the corners are used, so no table of that size is needed
+    stats s;
+    pair<int, int> ul(0, 0);
+    pair<int, int> lr(65535, 65535);
+    REQUIRE(s.rectArea(ul, lr) == 65536L * 65536L);
+}
+
 TEST_CASE("stats::basic getAvg", "[weight=1][part=stats]") {
     PNG data;
     data.resize(2, 2);
@@ -46,6 +58,189 @@ TEST_CASE("stats::basic getAvg", "[weight=1][part=stats]") {
     REQUIRE(result == expected);
 }
 
+TEST_CASE("stats::getAvg away from the origin", "[weight=1][part=stats]") {
+    PNG data;
+    data.resize(3, 3);
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            HSLAPixel *p = data.getPixel(i, j);
+            p->h = 0;
+            p->s = 0.0;
+            p->l = (i >= 1 && j >= 1) ? 0.25 * (i + j - 1) : 1.0;
+            p->a = 1.0;
+        }
+    }
+    stats s(data);
+    HSLAPixel inner = s.getAvg(pair<int, int>(1, 1), pair<int, int>(2, 2));
+    HSLAPixel right = s.getAvg(pair<int, int>(2, 0), pair<int, int>(2, 2));
+
+    REQUIRE(inner == HSLAPixel(0, 0.0, 0.5));
+    REQUIRE(right == HSLAPixel(0, 0.0, 2.25 / 3));
+}
+
+TEST_CASE("stats::exact sums do not depend on position",
+          "[weight=1][part=stats]") {
+    // a pattern repeating every 8 pixels: equal rectangles 8 apart hold
+    // the same pixels, so exact sums must give the same average
+    PNG data;
+    data.resize(260, 190);
+    for (unsigned x = 0; x < data.width(); x++) {
+        for (unsigned y = 0; y < data.height(); y++) {
+            HSLAPixel *p = data.getPixel(x, y);
+            p->h = ((x % 8) * 41 + (y % 8) * 29) % 360;
+            p->s = 0.1 + (x % 8) * 0.11;
+            p->l = 0.05 + (y % 8) * 0.13;
+        }
+    }
+    satMode modes[] = {SAT_FIXED64, SAT_QUANT8};
+    for (satMode mode : modes) {
+        stats s(data, 1, mode);
+        HSLAPixel first = s.getAvg(pair<int, int>(1, 2), pair<int, int>(6, 9));
+        HSLAPixel far =
+            s.getAvg(pair<int, int>(249, 178), pair<int, int>(254, 185));
+        REQUIRE(first.h == far.h);
+        REQUIRE(first.s == far.s);
+        REQUIRE(first.l == far.l);
+
+        stats exact(data, 1, SAT_DOUBLE);
+        REQUIRE(first == exact.getAvg(pair<int, int>(1, 2),
+                                      pair<int, int>(6, 9)));
+    }
+
+    // 8-bit levels: 0.5 is stored as 128 / 255
+    PNG flat;
+    flat.resize(3, 3);
+    for (unsigned x = 0; x < 3; x++) {
+        for (unsigned y = 0; y < 3; y++) {
+            *flat.getPixel(x, y) = HSLAPixel(90, 0.5, 0.5);
+        }
+    }
+    stats q(flat, 1, SAT_QUANT8);
+    HSLAPixel avg = q.getAvg(pair<int, int>(0, 0), pair<int, int>(2, 2));
+    REQUIRE(avg.s == 128 / 255.0);
+    REQUIRE(fabs(avg.h - 90) < 1e-6);
+}
+
+TEST_CASE("stats::cache file round trip", "[weight=1][part=stats]") {
+    PNG img;
+    img.readFromFile("images/ada.png");
+    img.resize(90, 70);
+    string file = "stats-cache-test.bin";
+
+    stats built(img, 1);
+    REQUIRE(built.writeToFile(file, img));
+
+    stats cached;
+    REQUIRE(cached.readFromFile(file, img));
+    REQUIRE(cached.sums.isView());
+    REQUIRE(memcmp(cached.sums.data(), built.sums.data(),
+                   built.sums.size() * sizeof(built.sums[0])) == 0);
+    REQUIRE(cached.histAbove == built.histAbove);
+    REQUIRE(cached.histLeft == built.histLeft);
+    REQUIRE(cached.histRows == built.histRows);
+    REQUIRE(cached.histCols == built.histCols);
+    REQUIRE(cached.histLocal == built.histLocal);
+    for (int x0 = 0; x0 < 90; x0 += 13) {
+        for (int y0 = 0; y0 < 70; y0 += 11) {
+            pair<int, int> ul(x0, y0);
+            pair<int, int> lr(x0 + (89 - x0) / 2, y0 + (69 - y0) / 3);
+            REQUIRE(cached.entropy(ul, lr) == built.entropy(ul, lr));
+            HSLAPixel a = cached.getAvg(ul, lr), b = built.getAvg(ul, lr);
+            REQUIRE((a.h == b.h && a.s == b.s && a.l == b.l));
+        }
+    }
+
+    // another image, bin count or mode must not pick the file up
+    PNG other = img;
+    other.getPixel(5, 5)->l = 0.125;
+    stats wrong;
+    binnedStats<72> wrongBins;
+    REQUIRE(!wrong.readFromFile(file, other));
+    REQUIRE(!wrongBins.readFromFile(file, img));
+    REQUIRE(!wrong.readFromFile(file, img, SAT_FIXED64));
+    REQUIRE(wrong.sums.empty());
+    REQUIRE(stats::cacheName(img) != stats::cacheName(other));
+
+    remove(file.c_str());
+}
+
+TEST_CASE("stats::sse matches the distances to the mean",
+          "[weight=1][part=stats]") {
+    PNG data;
+    data.resize(29, 23);
+    for (unsigned x = 0; x < data.width(); x++) {
+        for (unsigned y = 0; y < data.height(); y++) {
+            HSLAPixel *p = data.getPixel(x, y);
+            p->h = (x * 31 + y * 17) % 360;
+            p->s = ((x * y) % 7) / 6.0;
+            p->l = ((x + 2 * y) % 9) / 8.0;
+        }
+    }
+    stats s(data, 1);
+    s.buildMoments(data, 1);
+
+    int rects[][4] = {{0, 0, 28, 22}, {3, 4, 11, 19}, {7, 7, 7, 7}};
+    for (auto &r : rects) {
+        double n = (r[2] - r[0] + 1) * (r[3] - r[1] + 1);
+        double mx = 0, my = 0, ml = 0;
+        for (int x = r[0]; x <= r[2]; x++) {
+            for (int y = r[1]; y <= r[3]; y++) {
+                HSLAPixel *p = data.getPixel(x, y);
+                mx += cos(p->h * PI / 180) * p->s * p->l / n;
+                my += sin(p->h * PI / 180) * p->s * p->l / n;
+                ml += p->l / n;
+            }
+        }
+        double expected = 0.0;
+        for (int x = r[0]; x <= r[2]; x++) {
+            for (int y = r[1]; y <= r[3]; y++) {
+                HSLAPixel *p = data.getPixel(x, y);
+                double dx = cos(p->h * PI / 180) * p->s * p->l - mx;
+                double dy = sin(p->h * PI / 180) * p->s * p->l - my;
+                double dl = p->l - ml;
+                expected += dx * dx + dy * dy + dl * dl;
+            }
+        }
+        double result =
+            s.sse(pair<int, int>(r[0], r[1]), pair<int, int>(r[2], r[3]));
+        REQUIRE(fabs(result - expected) < 1e-9);
+    }
+}
+
+TEST_CASE("stats::distSum within its error bound", "[weight=1][part=stats]") {
+    PNG data;
+    data.resize(300, 200);
+    for (unsigned x = 0; x < data.width(); x++) {
+        for (unsigned y = 0; y < data.height(); y++) {
+            HSLAPixel *p = data.getPixel(x, y);
+            p->h = (x * 31 + y * 17) % 360;
+            p->s = ((x * y) % 7) / 6.0;
+            p->l = ((x + 2 * y) % 9) / 8.0;
+        }
+    }
+    stats s(data, 1);
+    s.buildMoments(data, 1);
+
+    HSLAPixel color(200, .4, .6);
+    int rects[][4] = {{0, 0, 0, 0}, {3, 4, 11, 19}, {290, 190, 299, 199},
+                      {298, 197, 298, 197}, {0, 0, 299, 199}};
+    for (auto &r : rects) {
+        pair<int, int> ul(r[0], r[1]), lr(r[2], r[3]);
+        long double expected = 0.0;
+        for (int x = r[0]; x <= r[2]; x++) {
+            for (int y = r[1]; y <= r[3]; y++) {
+                expected += color.dist(*data.getPixel(x, y));
+            }
+        }
+        double error = s.distSumError(ul, lr, color);
+        REQUIRE(fabsl(s.distSum(ul, lr, color) - expected) <= error);
+        // even far from (0,0), well below 1e-9 per pixel of the image
+        REQUIRE(error < 1e-6);
+    }
+    REQUIRE(s.distSumError(pair<int, int>(0, 0), pair<int, int>(0, 0),
+                           color) < 1e-14);
+}
+
 TEST_CASE("stats::basic entropy", "[weight=1][part=stats]") {
     PNG data;
     data.resize(2, 2);
@@ -66,6 +261,282 @@ TEST_CASE("stats::basic entropy", "[weight=1][part=stats]") {
     REQUIRE(result == 2);
 }
 
+TEST_CASE("stats::entropy across histogram tiles", "[weight=1][part=stats]") {
+    PNG data;
+    data.resize(37, 35);
+    for (unsigned x = 0; x < data.width(); x++) {
+        for (unsigned y = 0; y < data.height(); y++) {
+            data.getPixel(x, y)->h = (x * 7 + y * y * 13 + x * y) % 360;
+        }
+    }
+    stats s(data);
+
+    int rects[][4] = {{0, 0, 36, 34}, {3, 5, 20, 17},  {15, 15, 16, 16},
+                      {16, 0, 31, 34}, {17, 18, 36, 33}, {5, 31, 5, 34}};
+    for (auto &r : rects) {
+        vector<int> distn(36, 0);
+        for (int x = r[0]; x <= r[2]; x++) {
+            for (int y = r[1]; y <= r[3]; y++) {
+                distn[(int)(data.getPixel(x, y)->h / 10)]++;
+            }
+        }
+        double area = (r[2] - r[0] + 1) * (r[3] - r[1] + 1);
+        double expected = 0.0;
+        for (int k = 0; k < 36; k++) {
+            if (distn[k] > 0) {
+                expected -= distn[k] / area * log2(distn[k] / area);
+            }
+        }
+        double result = s.entropy(pair<int, int>(r[0], r[1]),
+                                  pair<int, int>(r[2], r[3]));
+        REQUIRE(fabs(result - expected) < 1e-9);
+    }
+}
+
+TEST_CASE("stats::histogram across super tiles", "[weight=1][part=stats]") {
+    // one bin fills the first super tile, so the 16-bit parts reach
+    // their largest values
+    PNG data;
+    data.resize(530, 290);
+    for (unsigned x = 0; x < data.width(); x++) {
+        for (unsigned y = 0; y < data.height(); y++) {
+            bool full = (x < 300 && y < 270);
+            data.getPixel(x, y)->h = full ? 5 : (x * 7 + y * 13 + x * y) % 360;
+        }
+    }
+    stats serial(data, 1);
+    stats threaded(data, 4);
+    REQUIRE(serial.histAbove == threaded.histAbove);
+    REQUIRE(serial.histLeft == threaded.histLeft);
+    REQUIRE(serial.histRows == threaded.histRows);
+    REQUIRE(serial.histCols == threaded.histCols);
+    REQUIRE(serial.histLocal == threaded.histLocal);
+
+    // H(x,y) of every corner against a brute force integral
+    size_t w = data.width() + 1;
+    vector<int32_t> integral(w * (data.height() + 1) * 36, 0);
+    alignas(16) int32_t counts[36];
+    bool match = true;
+    for (unsigned y = 1; y <= data.height(); y++) {
+        for (unsigned x = 1; x <= data.width(); x++) {
+            int32_t *h = &integral[(y * w + x) * 36];
+            const int32_t *up = h - w * 36, *left = h - 36, *diag = up - 36;
+            for (int k = 0; k < 36; k++) {
+                h[k] = up[k] + left[k] - diag[k];
+            }
+            h[(int)(data.getPixel(x - 1, y - 1)->h / 10)]++;
+            serial.histDiff(x, y, 0, 0, counts);
+            match = match && equal(counts, counts + 36, h);
+        }
+    }
+    REQUIRE(match);
+}
+
+/**
+ * Checks binnedStats<BINS>::entropy against a brute force histogram of
+ * BINS bins, on every kernel.
+ */
+template <int BINS>
+void checkBinnedEntropy(PNG &data) {
+    binnedStats<BINS> s(data, 1);
+    int rects[][4] = {{0, 0, 36, 34}, {3, 5, 20, 17}, {17, 18, 36, 33}};
+    for (auto &r : rects) {
+        vector<int> distn(BINS, 0);
+        for (int x = r[0]; x <= r[2]; x++) {
+            for (int y = r[1]; y <= r[3]; y++) {
+                distn[(int)(data.getPixel(x, y)->h * BINS / 360)]++;
+            }
+        }
+        double area = (r[2] - r[0] + 1) * (r[3] - r[1] + 1);
+        double expected = 0.0;
+        for (int k = 0; k < BINS; k++) {
+            if (distn[k] > 0) {
+                expected -= distn[k] / area * log2(distn[k] / area);
+            }
+        }
+        for (int l = SIMD_SCALAR; l <= detectSimdLevel(); l++) {
+            setSimdLevel((simdLevel)l);
+            double result = s.entropy(pair<int, int>(r[0], r[1]),
+                                      pair<int, int>(r[2], r[3]));
+            REQUIRE(fabs(result - expected) < 1e-9);
+        }
+    }
+    setSimdLevel(detectSimdLevel());
+}
+
+TEST_CASE("stats::entropy with 16 and 72 bins", "[weight=1][part=stats]") {
+    PNG data;
+    data.resize(37, 35);
+    for (unsigned x = 0; x < data.width(); x++) {
+        for (unsigned y = 0; y < data.height(); y++) {
+            data.getPixel(x, y)->h = (x * 7 + y * y * 13 + x * y) % 360;
+        }
+    }
+    checkBinnedEntropy<16>(data);
+    checkBinnedEntropy<72>(data);
+}
+
+TEST_CASE("stats::entropy kernels agree", "[weight=1][part=stats]") {
+    PNG data;
+    data.resize(41, 23);
+    for (unsigned x = 0; x < data.width(); x++) {
+        for (unsigned y = 0; y < data.height(); y++) {
+            data.getPixel(x, y)->h = (x * x * 11 + y * 29 + x * y * 3) % 360;
+        }
+    }
+    stats s(data);
+
+    for (int x0 = 0; x0 < 41; x0 += 5) {
+        for (int y0 = 0; y0 < 23; y0 += 3) {
+            pair<int, int> ul(x0, y0);
+            pair<int, int> lr(x0 + (40 - x0) / 2, y0 + (22 - y0) / 3);
+            setSimdLevel(SIMD_SCALAR);
+            double scalar = s.entropy(ul, lr);
+            for (int l = SIMD_SSE2; l <= detectSimdLevel(); l++) {
+                setSimdLevel((simdLevel)l);
+                REQUIRE(s.entropy(ul, lr) == scalar);
+            }
+        }
+    }
+    setSimdLevel(detectSimdLevel());
+}
+
+TEST_CASE("stats::entropy nlogn table fallback", "[weight=1][part=stats]") {
+    alignas(32) int32_t counts[40] = {0};
+    counts[0] = 5;
+    counts[7] = 1000;
+    counts[35] = 70000;
+    long area = 71005;
+
+    nlognTable full(area);
+    nlognTable tiny(2);
+    for (int l = SIMD_SCALAR; l <= detectSimdLevel(); l++) {
+        setSimdLevel((simdLevel)l);
+        REQUIRE(countEntropy<36>(counts, area, tiny) ==
+                countEntropy<36>(counts, area, full));
+    }
+    setSimdLevel(detectSimdLevel());
+
+    alignas(32) int32_t pure[40] = {0};
+    pure[12] = 4321;
+    REQUIRE(countEntropy<36>(pure, 4321, full) == 0.0);
+}
+
+TEST_CASE("stats::threaded build matches serial", "[weight=1][part=stats]") {
+    PNG data;
+    data.resize(53, 70);
+    for (unsigned x = 0; x < data.width(); x++) {
+        for (unsigned y = 0; y < data.height(); y++) {
+            HSLAPixel *p = data.getPixel(x, y);
+            p->h = (x * 13 + y * y * 7 + x * y) % 360;
+            p->s = ((x + y) % 11) / 10.0;
+            p->l = ((x * y) % 17) / 16.0;
+        }
+    }
+    stats serial(data, 1);
+    for (int threads = 2; threads <= 7; threads += 5) {
+        stats threaded(data, threads);
+        REQUIRE(memcmp(&serial.sums[0], &threaded.sums[0],
+                       serial.sums.size() * sizeof(serial.sums[0])) == 0);
+        REQUIRE(serial.histAbove == threaded.histAbove);
+        REQUIRE(serial.histLeft == threaded.histLeft);
+        REQUIRE(serial.histRows == threaded.histRows);
+        REQUIRE(serial.histCols == threaded.histCols);
+        REQUIRE(serial.histLocal == threaded.histLocal);
+    }
+}
+
+TEST_CASE("stats::queries do not allocate", "[weight=1][part=stats]") {
+    PNG data;
+    data.resize(45, 38);
+    for (unsigned x = 0; x < data.width(); x++) {
+        for (unsigned y = 0; y < data.height(); y++) {
+            data.getPixel(x, y)->h = (x * 17 + y * 5 + x * y * y) % 360;
+        }
+    }
+    stats s(data, 1);
+
+    long before = allocationCount();
+    double total = 0.0;
+    alignas(32) int32_t counts[40];
+    for (int x0 = 0; x0 < 44; x0 += 4) {
+        for (int y0 = 0; y0 < 38; y0 += 3) {
+            pair<int, int> ul(x0, y0);
+            pair<int, int> lr(x0 + (44 - x0) / 3, y0 + (37 - y0) / 2);
+            pair<int, int> mid(x0, lr.second);
+            pair<int, int> next(x0 + 1, y0);
+            total += s.entropy(ul, lr) + s.getAvg(ul, lr).h;
+            total += s.weightedSumEntropy(ul, mid, next, lr);
+            s.histDiff(lr.first + 1, lr.second + 1, x0, lr.second + 1, counts);
+            pair<int, int> top(x0, 0);
+            total += s.countsEntropy(counts, s.rectArea(top, lr));
+            double profile[44];
+            s.splitProfile(ul, lr, true, profile);
+            total += profile[0];
+        }
+    }
+    long during = allocationCount() - before;
+
+    REQUIRE(total > 0.0);
+    REQUIRE(during == 0);
+}
+
+TEST_CASE("stats::split profile", "[weight=1][part=stats]") {
+    PNG data;
+    data.readFromFile("images/ada.png");
+    data.resize(60, 50);
+    stats s(data);
+
+    pair<int, int> ul(3, 7), lr(52, 41);
+    for (int vert = 0; vert < 2; vert++) {
+        int lo = vert ? ul.first : ul.second;
+        int hi = vert ? lr.first : lr.second;
+        double profile[60], bounded[60];
+        REQUIRE(s.splitProfile(ul, lr, vert, profile) == hi - lo);
+        double lowest = HUGE_VAL;
+        for (int i = lo; i < hi; i++) {
+            pair<int, int> ltlr(vert ? i : lr.first, vert ? lr.second : i);
+            pair<int, int> rbul(vert ? i + 1 : ul.first,
+                                vert ? ul.second : i + 1);
+            REQUIRE(profile[i - lo] ==
+                    s.weightedSumEntropy(ul, ltlr, rbul, lr));
+            lowest = min(lowest, profile[i - lo]);
+        }
+
+        // bounded, every line is either exact or provably worse
+        long evaluated =
+            s.splitProfile(ul, lr, vert, bounded, profile[(hi - lo) / 2]);
+        REQUIRE(evaluated <= hi - lo);
+        for (int j = 0; j < hi - lo; j++) {
+            REQUIRE((bounded[j] == profile[j] ||
+                     (bounded[j] == HUGE_VAL && profile[j] > lowest)));
+        }
+    }
+}
+
+TEST_CASE("stats::construction allocations do not grow with the image",
+          "[weight=1][part=stats]") {
+    PNG small;
+    small.resize(20, 20);
+    PNG large;
+    large.resize(300, 200);
+
+    long before = allocationCount();
+    stats s1(small, 1);
+    long smallAllocs = allocationCount() - before;
+    before = allocationCount();
+    stats s2(large, 1);
+    long largeAllocs = allocationCount() - before;
+
+    REQUIRE(smallAllocs == largeAllocs);
+
+    // the aligned tables are counted too
+    before = allocationCount();
+    flatTable<double> table;
+    table.assign(1000, 0.0);
+    REQUIRE(allocationCount() - before == 1);
+}
+
 TEST_CASE("twoDtree::basic ctor render", "[weight=1][part=twoDtree]") {
     PNG img;
     img.readFromFile("images/ada.png");
@@ -77,6 +548,105 @@ TEST_CASE("twoDtree::basic ctor render", "[weight=1][part=twoDtree]") {
     REQUIRE(out == img);
 }
 
+TEST_CASE("twoDtree::ctor render with other bin counts",
+          "[weight=1][part=twoDtree]") {
+    PNG img;
+    img.readFromFile("images/ada.png");
+    img.resize(64, 80);
+
+    histBins bins[] = {BINS_16, BINS_72};
+    for (histBins b : bins) {
+        buildOptions opts;
+        opts.bins = b;
+        twoDtree t(img, opts);
+        REQUIRE(t.render() == img);
+    }
+}
+
+TEST_CASE("twoDtree::build through the stats cache",
+          "[weight=1][part=twoDtree]") {
+    PNG img;
+    img.readFromFile("images/ada.png");
+    img.resize(48, 60);
+
+    buildOptions opts;
+    opts.cacheDir = ".";
+    string file = "./" + stats::cacheName(img);
+    remove(file.c_str());
+    twoDtree first(img, opts);  // builds and writes the file
+    struct stat st;
+    REQUIRE(stat(file.c_str(), &st) == 0);
+    twoDtree second(img, opts); // reads it back
+
+    REQUIRE(first.render() == img);
+    REQUIRE(second.render() == img);
+    remove(file.c_str());
+}
+
+TEST_CASE("twoDtree::variance cost", "[weight=1][part=twoDtree]") {
+    PNG img;
+    img.readFromFile("images/ada.png");
+    img.resize(64, 80);
+    twoDtree t(img, buildOptions(), varianceCost());
+    REQUIRE(t.render() == img);
+
+    // the scan of the entropy policy is the spec's tree
+    buildOptions scan;
+    scan.search = SEARCH_SCAN;
+    twoDtree e1(img, scan, entropyCost());
+    twoDtree e2(img);
+    e1.prune(.05);
+    e2.prune(.05);
+    REQUIRE(e1.render() == e2.render());
+}
+
+TEST_CASE("twoDtree::coarse search", "[weight=1][part=twoDtree]") {
+    PNG img;
+    img.readFromFile("images/color.png");
+    img.resize(160, 120);
+
+    // a stride of one is an exhaustive search
+    buildOptions exact;
+    exact.search = SEARCH_COARSE;
+    exact.coarseStride = 1;
+    twoDtree t1(img, exact);
+    twoDtree t2(img);
+    t1.prune(.05);
+    t2.prune(.05);
+    REQUIRE(t1.render() == t2.render());
+
+    buildOptions coarse;
+    coarse.search = SEARCH_COARSE;
+    searchAudit audit;
+    coarse.audit = &audit;
+    twoDtree t3(img, coarse);
+    REQUIRE(t3.render() == img);
+    REQUIRE(audit.searches > 0);
+    REQUIRE(audit.mismatches <= audit.searches);
+    REQUIRE(audit.evaluated < audit.exhaustive);
+    REQUIRE(audit.excess >= 0.0);
+}
+
+TEST_CASE("twoDtree::bounded search", "[weight=1][part=twoDtree]") {
+    PNG img;
+    img.readFromFile("images/color.png");
+    img.resize(160, 120);
+
+    buildOptions bounded;
+    bounded.search = SEARCH_BOUND;
+    searchAudit audit;
+    bounded.audit = &audit;
+    twoDtree t1(img, bounded);
+    twoDtree t2(img);
+    REQUIRE(t1.render() == img);
+    t1.prune(.05);
+    t2.prune(.05);
+    REQUIRE(t1.render() == t2.render());
+    REQUIRE(audit.searches > 0);
+    REQUIRE(audit.mismatches == 0);
+    REQUIRE(audit.evaluated < audit.exhaustive);
+}
+
 TEST_CASE("twoDtree::basic copy", "[weight=1][part=twoDtree]") {
     PNG img;
     img.readFromFile("images/ada.png");
@@ -89,6 +659,253 @@ TEST_CASE("twoDtree::basic copy", "[weight=1][part=twoDtree]") {
     REQUIRE(out == img);
 }
 
+TEST_CASE("twoDtree::copies are shared and independent",
+          "[weight=1][part=twoDtree]") {
+    PNG img;
+    img.readFromFile("images/ada.png");
+    img.resize(64, 80);
+
+    twoDtree t1(img);
+    long before = allocationCount();
+    twoDtree t2(t1);
+    REQUIRE(allocationCount() - before == 0);
+
+    t1.prune(.05);
+    PNG pruned = t1.render();
+    REQUIRE(t2.render() == img);
+    REQUIRE(!(pruned == img));
+
+    twoDtree t3(t2);
+    t2 = t1;
+    t2 = t2;
+    REQUIRE(t2.render() == pruned);
+    t3.prune(.05);
+    REQUIRE(t3.render() == pruned);
+}
+
+TEST_CASE("twoDtree::moves and rendering in place",
+          "[weight=1][part=twoDtree]") {
+    REQUIRE(is_nothrow_move_constructible<PNG>::value);
+    REQUIRE(is_nothrow_move_assignable<PNG>::value);
+    REQUIRE(is_nothrow_move_constructible<twoDtree>::value);
+    REQUIRE(is_nothrow_move_assignable<twoDtree>::value);
+
+    PNG img;
+    img.readFromFile("images/ada.png");
+    img.resize(64, 80);
+    PNG moved(std::move(img));
+    REQUIRE(img.width() == 0);
+    REQUIRE(moved.width() == 64);
+
+    twoDtree t1(moved);
+    PNG expected = t1.render();
+    twoDtree t2(std::move(t1));
+    REQUIRE(t1.render().width() == 0);
+    REQUIRE(t2.render() == expected);
+    t1 = std::move(t2);
+    REQUIRE(t1.render() == expected);
+
+    PNG out;
+    t1.render(out);
+    REQUIRE(out == expected);
+    long before = allocationCount();
+    t1.render(out);
+    REQUIRE(allocationCount() - before == 0);
+    REQUIRE(out == expected);
+}
+
+TEST_CASE("twoDtree::packed copy", "[weight=1][part=twoDtree]") {
+    PNG img;
+    img.readFromFile("images/color.png");
+    img.resize(90, 70);
+
+    twoDtree t(img);
+    packedTree full = t.pack();
+    REQUIRE(full.size() == 2 * 90 * 70 - 1);
+    REQUIRE(full.render() == img);
+
+    t.prune(.05);
+    packedTree pruned = t.pack();
+    REQUIRE(pruned.size() < full.size());
+    REQUIRE(pruned.render() == t.render());
+    REQUIRE(packedTree().render() == PNG());
+}
+
+TEST_CASE("twoDtree::parallel build matches serial",
+          "[weight=1][part=twoDtree]") {
+    PNG img;
+    img.readFromFile("images/color.png");
+    img.resize(120, 90);
+
+    buildOptions serial;
+    serial.threads = 1;
+    buildOptions parallel;
+    parallel.threads = 4;
+    parallel.grain = 64;
+    parallel.splitGrain = 256;
+    splitSearch searches[] = {SEARCH_BOUND, SEARCH_SWEEP, SEARCH_SCAN};
+    for (splitSearch search : searches) {
+        serial.search = search;
+        parallel.search = search;
+        twoDtree t1(img, serial);
+        twoDtree t2(img, parallel);
+        REQUIRE(t2.pack().size() == t1.pack().size());
+        REQUIRE(t2.render() == img);
+        t1.prune(.05);
+        t2.prune(.05);
+        REQUIRE(t2.pack().size() == t1.pack().size());
+        REQUIRE(t2.render() == t1.render());
+    }
+
+    twoDtree v1(img, serial, varianceCost());
+    twoDtree v2(img, parallel, varianceCost());
+    v1.prune(.1);
+    v2.prune(.1);
+    REQUIRE(v2.render() == v1.render());
+}
+
+TEST_CASE("twoDtree::deep trees do not recurse", "[weight=1][part=twoDtree]") {
+    // a uniform strip splits at its last line, so the tree is as deep
+    // as the strip is long; the parallel build must not recurse either,
+    // whatever the number of cores
+    PNG strips[] = {PNG(1, 200000), PNG(200000, 1)};
+    buildOptions parallel;
+    parallel.threads = 4;
+    parallel.grain = 1;
+    for (PNG &img : strips) {
+        REQUIRE(twoDtree(img, parallel).render() == img);
+        twoDtree t(img);
+        REQUIRE(t.pack().render() == img);
+        twoDtree copy(t);
+        copy.prune(.05);
+        REQUIRE(copy.pack().size() == 1);
+        REQUIRE(t.render() == img);
+        REQUIRE(copy.render() == img);
+    }
+}
+
+TEST_CASE("twoDtree::leaf budget", "[weight=1][part=twoDtree]") {
+    PNG img;
+    img.readFromFile("images/color.png");
+    img.resize(40, 30);
+    twoDtree full(img);
+
+    buildOptions opts;
+    opts.maxLeaves = 1;
+    twoDtree one(img, opts);
+    REQUIRE(one.pack().size() == 1);
+    opts.maxLeaves = 100;
+    twoDtree some(img, opts);
+    REQUIRE(some.pack().size() == 199);
+    opts.maxLeaves = 50;
+    twoDtree variance(img, opts, varianceCost());
+    REQUIRE(variance.pack().size() == 99);
+
+    // a budget of every pixel makes every split of the full tree
+    opts.maxLeaves = 40 * 30;
+    twoDtree all(img, opts);
+    REQUIRE(all.pack().size() == full.pack().size());
+    REQUIRE(all.render() == full.render());
+    REQUIRE(all.render() == img);
+}
+
+TEST_CASE("twoDtree::build already pruned", "[weight=1][part=twoDtree]") {
+    PNG img;
+    img.readFromFile("images/color.png");
+    PNG expected;
+    expected.readFromFile("images/given-color.05.png");
+    buildOptions opts;
+    opts.tol = .05;
+    twoDtree given(img, opts);
+    REQUIRE(given.render() == expected);
+    twoDtree givenPruned(img);
+    givenPruned.prune(.05);
+    REQUIRE(given.pack() == givenPruned.pack());
+
+    // serial and parallel, and with rounded sums, whose leaves are not
+    // quite the pixels of the moment table
+    img.resize(80, 60);
+    buildOptions parallel;
+    parallel.threads = 4;
+    parallel.grain = 64;
+    buildOptions quant;
+    quant.sums = SAT_QUANT8;
+    double tols[] = {0.0, .0002, .001, .01, .05, .2, 1.0};
+    for (double tol : tols) {
+        twoDtree pruned(img);
+        pruned.prune(tol);
+        opts.tol = tol;
+        twoDtree built(img, opts);
+        REQUIRE(built.pack() == pruned.pack());
+        parallel.tol = tol;
+        REQUIRE(twoDtree(img, parallel).pack() == built.pack());
+
+        quant.tol = 0.0;
+        twoDtree quantPruned(img, quant);
+        quantPruned.prune(tol);
+        quant.tol = tol;
+        twoDtree quantBuilt(img, quant);
+        REQUIRE(quantBuilt.pack() == quantPruned.pack());
+    }
+}
+
+TEST_CASE("twoDtree::prune by color bounds", "[weight=1][part=twoDtree]") {
+    // blocks of close colors with some stray pixels, so that many
+    // subtrees are decided neither way by their bounds alone
+    PNG img(48, 40);
+    for (int y = 0; y < 40; y++) {
+        for (int x = 0; x < 48; x++) {
+            HSLAPixel *p = img.getPixel(x, y);
+            int block = (x / 12) + 4 * (y / 10);
+            p->h = (block * 47 + (x * 7 + y * 3) % 5) % 360;
+            p->s = .5 + .02 * ((x + y) % 3);
+            p->l = .5 + .01 * (x % 4);
+            if ((x * 31 + y * 17) % 97 == 0) {
+                p->l = .9;
+            }
+        }
+    }
+    double tols[] = {.0005, .001, .002, .005, .02, .1};
+    for (double tol : tols) {
+        twoDtree pruned(img);
+        pruned.prune(tol);
+        buildOptions opts;
+        opts.tol = tol;
+        twoDtree built(img, opts);
+        REQUIRE(pruned.pack() == built.pack());
+
+        // decided by the farthest leaves leafCount found instead
+        twoDtree annotated(img);
+        annotated.leafCount(tol);
+        annotated.prune(tol);
+        REQUIRE(annotated.pack() == pruned.pack());
+    }
+}
+
+TEST_CASE("twoDtree::render at a tolerance", "[weight=1][part=twoDtree]") {
+    PNG img;
+    img.readFromFile("images/color.png");
+    twoDtree t(img);
+    size_t size = t.pack().size();
+    PNG expected;
+    expected.readFromFile("images/given-color.05.png");
+    REQUIRE(t.render(.05) == expected);
+
+    double tols[] = {0.0, .001, .01, .05, .2, 1.0};
+    for (double tol : tols) {
+        twoDtree pruned(t);
+        pruned.prune(tol);
+        REQUIRE(t.render(tol) == pruned.render());
+        REQUIRE(t.leafCount(tol) == (pruned.pack().size() + 1) / 2);
+        // thresholds are worked out again for a pruned tree
+        twoDtree twice(pruned);
+        twice.prune(tol / 2);
+        REQUIRE(pruned.render(tol / 2) == twice.render());
+    }
+    REQUIRE(t.pack().size() == size);
+    REQUIRE(t.render() == img);
+}
+
 TEST_CASE("twoDtree::basic prune", "[weight=1][part=twoDtree]") {
     PNG img;
     img.readFromFile("images/color.png");
@@ -104,3 +921,31 @@ TEST_CASE("twoDtree::basic prune", "[weight=1][part=twoDtree]") {
 
     REQUIRE(expected == result);
 }
+
+TEST_CASE("twoDtree::sweep search matches scan", "[weight=1][part=twoDtree]") {
+    PNG img;
+    img.readFromFile("images/color.png");
+    img.resize(160, 120);
+
+    buildOptions scan;
+    scan.search = SEARCH_SCAN;
+    buildOptions sweep;
+    sweep.search = SEARCH_SWEEP;
+    twoDtree t1(img, scan);
+    twoDtree t2(img, sweep);
+    // every split line, before a prune can hide one
+    REQUIRE(t1.pack() == t2.pack());
+    t1.prune(.05);
+    t2.prune(.05);
+
+    REQUIRE(t1.render() == t2.render());
+
+    // stripes, so that many lines tie and the last of them must win
+    PNG stripes(37, 29);
+    for (int y = 0; y < 29; y++) {
+        for (int x = 0; x < 37; x++) {
+            *stripes.getPixel(x, y) = HSLAPixel((x % 3) * 120, .8, .5);
+        }
+    }
+    REQUIRE(twoDtree(stripes, scan).pack() == twoDtree(stripes, sweep).pack());
+}
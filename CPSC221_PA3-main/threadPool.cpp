@@ -0,0 +1,97 @@
+#include "threadPool.h"
+#include "parallel.h"
+
+namespace {
+// the pool the calling thread works for, and its deque there
+thread_local const threadPool *currentPool = NULL;
+thread_local int currentIndex = 0;
+} // namespace
+
+threadPool::threadPool(int threads) : queued(0), stopping(false) {
+    int n = resolveThreads(threads);
+    for (int i = 0; i < n; i++) {
+        queues.push_back(std::unique_ptr<taskQueue>(new taskQueue()));
+    }
+    for (int i = 1; i < n; i++) {
+        workers.push_back(std::thread(&threadPool::work, this, i));
+    }
+}
+
+threadPool::~threadPool() {
+    {
+        std::lock_guard<std::mutex> guard(idleLock);
+        stopping = true;
+    }
+    idle.notify_all();
+    for (size_t i = 0; i < workers.size(); i++) {
+        workers[i].join();
+    }
+}
+
+int threadPool::self() const {
+    return (currentPool == this) ? currentIndex : 0;
+}
+
+void threadPool::submit(std::function<void()> task) {
+    taskQueue &queue = *queues[self()];
+    {
+        std::lock_guard<std::mutex> guard(queue.lock);
+        queue.tasks.push_back(std::move(task));
+    }
+    queued++;
+    if (!workers.empty()) {
+        // taking the lock orders this with a worker about to sleep
+        std::lock_guard<std::mutex> guard(idleLock);
+        idle.notify_one();
+    }
+}
+
+bool threadPool::runOne() {
+    std::function<void()> task;
+    if (!take(self(), task)) {
+        return false;
+    }
+    task();
+    return true;
+}
+
+bool threadPool::take(int index, std::function<void()> &task) {
+    if (queued == 0) {
+        return false;
+    }
+    int n = size();
+    for (int k = 0; k < n; k++) {
+        taskQueue &queue = *queues[(index + k) % n];
+        std::lock_guard<std::mutex> guard(queue.lock);
+        if (!queue.tasks.empty()) {
+            if (k == 0) {
+                task = std::move(queue.tasks.back());
+                queue.tasks.pop_back();
+            } else {
+                task = std::move(queue.tasks.front());
+                queue.tasks.pop_front();
+            }
+            queued--;
+            return true;
+        }
+    }
+    return false;
+}
+
+void threadPool::work(int index) {
+    currentPool = this;
+    currentIndex = index;
+    std::function<void()> task;
+    while (true) {
+        if (take(index, task)) {
+            task();
+            task = nullptr;
+            continue;
+        }
+        std::unique_lock<std::mutex> guard(idleLock);
+        idle.wait(guard, [this]() { return stopping || queued > 0; });
+        if (stopping && queued == 0) {
+            return;
+        }
+    }
+}
@@ -0,0 +1,190 @@
+/**
+ * @file threadPool.h
+ * A work-stealing pool for recursive fork-join work, such as building
+ * the two subtrees of a twoDtree node at once. Every thread of the pool
+ * keeps its own deque of tasks: it pushes and pops new tasks at the back,
+ * so it works depth first on what it just split, and idle threads steal
+ * from the front of the others, taking the oldest, largest tasks.
+ */
+
+#ifndef _THREADPOOL_H_
+#define _THREADPOOL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class threadPool {
+public:
+    /**
+     * Starts threads - 1 workers; the thread that creates the pool is the
+     * last one, and works while it waits in taskGroup::wait.
+     *
+     * @param threads number of threads, see resolveThreads
+     */
+    explicit threadPool(int threads);
+
+    /**
+     * Stops the workers. Every task group must have been waited for.
+     */
+    ~threadPool();
+
+    /**
+     * Returns the number of threads, counting the creating one.
+     */
+    int size() const {
+        return (int)queues.size();
+    }
+
+    /**
+     * Queues a task on the calling thread's deque; calls from outside
+     * the pool go to the creating thread's.
+     */
+    void submit(std::function<void()> task);
+
+    /**
+     * Runs one queued task, the calling thread's newest or else one
+     * stolen from another thread. Returns false if there was none.
+     */
+    bool runOne();
+
+private:
+    threadPool(const threadPool &);
+    threadPool &operator=(const threadPool &);
+
+    struct taskQueue {
+        std::mutex lock;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    /**
+     * Returns the deque of the calling thread.
+     */
+    int self() const;
+
+    /**
+     * Takes the newest task of queue index, or the oldest of another
+     * queue. Returns false if all are empty.
+     */
+    bool take(int index, std::function<void()> &task);
+
+    /**
+     * Body of worker thread index.
+     */
+    void work(int index);
+
+    std::vector<std::unique_ptr<taskQueue>> queues;
+    std::vector<std::thread> workers;
+
+    // idle workers sleep until a task is queued or the pool stops
+    std::mutex idleLock;
+    std::condition_variable idle;
+    std::atomic<long> queued;
+    bool stopping;
+};
+
+/**
+ * Tasks run on a pool that a caller waits for together. wait() keeps
+ * the waiting thread busy with queued tasks, so tasks may create and
+ * wait for groups of their own without blocking the pool.
+ */
+class taskGroup {
+public:
+    explicit taskGroup(threadPool &pool) : owner(pool), pending(0) {}
+
+    /**
+     * Returns the pool the group's tasks run on.
+     */
+    threadPool &pool() {
+        return owner;
+    }
+
+    /**
+     * Queues task on the pool as part of this group.
+     */
+    template <class F>
+    void run(F task) {
+        pending++;
+        std::atomic<long> *count = &pending;
+        owner.submit([task, count]() {
+            task();
+            (*count)--;
+        });
+    }
+
+    /**
+     * Returns once every task of the group has finished.
+     */
+    void wait() {
+        while (pending > 0) {
+            if (!owner.runOne()) {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+private:
+    threadPool &owner;
+    std::atomic<long> pending;
+};
+
+/**
+ * Calls body(lo, hi) on contiguous chunks covering [begin, end), and
+ * returns once every chunk is done; with no pool, or a pool of one
+ * thread, it makes a single call body(begin, end). Like parallelFor, but
+ * for callers that are tasks of the pool themselves.
+ *
+ * The caller and one helper task per other thread of the pool claim
+ * chunks from a shared counter. The caller only ever runs chunks, and
+ * then waits for those claimed by helpers, so unlike taskGroup::wait it
+ * never runs unrelated tasks on its stack: a deep chain of tasks that
+ * each split a range cannot nest. Helpers that start after the last
+ * chunk was claimed return at once.
+ *
+ * @param pool the pool to run on, or NULL
+ * @param begin first index of the range
+ * @param end one past the last index of the range
+ * @param body callable taking the bounds (lo, hi) of one chunk
+ */
+template <class F>
+void forEachChunk(threadPool *pool, long begin, long end, F body) {
+    long n = end - begin;
+    long chunks = (pool == NULL) ? 1 : 4L * pool->size();
+    if (chunks > n) {
+        chunks = n;
+    }
+    if (chunks <= 1 || pool->size() == 1) {
+        if (n > 0) {
+            body(begin, end);
+        }
+        return;
+    }
+    // shared with the helpers, which may outlive this call
+    struct chunkCounts {
+        std::atomic<long> claimed;
+        std::atomic<long> done;
+    };
+    std::shared_ptr<chunkCounts> counts = std::make_shared<chunkCounts>();
+    counts->claimed = 0;
+    counts->done = 0;
+    auto claim = [counts, body, begin, n, chunks]() {
+        for (long c = counts->claimed++; c < chunks; c = counts->claimed++) {
+            body(begin + n * c / chunks, begin + n * (c + 1) / chunks);
+            counts->done++;
+        }
+    };
+    for (int t = 1; t < pool->size(); t++) {
+        pool->submit(claim);
+    }
+    claim();
+    while (counts->done < chunks) {
+        std::this_thread::yield();
+    }
+}
+
+#endif
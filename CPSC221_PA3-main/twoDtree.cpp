@@ -9,8 +9,14 @@
 
 #include "twoDtree.h"
 
-twoDtree::Node::Node(pair<int, int> ul, pair<int, int> lr, HSLAPixel a)
-    : upLeft(ul), lowRight(lr), avg(a), LT(NULL), RB(NULL) {}
+#include <algorithm>
+#include <cmath>
+#include <queue>
+
+constexpr uint32_t twoDtree::NONE;
+
+twoDtree::Node::Node(HSLAPixel a)
+    : avg(a), LT(NONE), RB(NONE), split(0), vert(false) {}
 
 twoDtree::~twoDtree() {
     clear();
@@ -20,13 +26,223 @@ twoDtree::twoDtree(const twoDtree &other) {
     copy(other);
 }
 
+twoDtree::twoDtree(twoDtree &&other) noexcept
+    : shared(std::move(other.shared)), root(other.root),
+      collapse(std::move(other.collapse)), height(other.height),
+      width(other.width) {
+    other.root = NONE;
+    other.height = 0;
+    other.width = 0;
+}
+
 twoDtree::twoDtree(PNG &imIn) {
-    stats s(imIn);
-    pair<int, int> ul(0, 0);
-    pair<int, int> lr(imIn.width() - 1, imIn.height() - 1);
     width = imIn.width();
     height = imIn.height();
-    root = buildTree(s, ul, lr, true);
+    root = buildWith<stats>(imIn, buildOptions(), entropyCost());
+}
+
+twoDtree::twoDtree(PNG &imIn, const buildOptions &opts)
+    : twoDtree(imIn, opts, entropyCost()) {}
+
+template <class Cost>
+twoDtree::twoDtree(PNG &imIn, const buildOptions &opts, const Cost &cost) {
+    width = imIn.width();
+    height = imIn.height();
+    switch (opts.bins) {
+    case BINS_16:
+        root = buildWith<binnedStats<16>>(imIn, opts, cost);
+        break;
+    case BINS_72:
+        root = buildWith<binnedStats<72>>(imIn, opts, cost);
+        break;
+    default:
+        root = buildWith<stats>(imIn, opts, cost);
+        break;
+    }
+}
+
+// the cost policies of splitCost.h
+template twoDtree::twoDtree(PNG &, const buildOptions &, const entropyCost &);
+template twoDtree::twoDtree(PNG &, const buildOptions &,
+                            const varianceCost &);
+
+template <class S, class Cost>
+uint32_t twoDtree::buildWith(PNG &imIn, const buildOptions &opts,
+                             const Cost &cost) {
+    S s;
+    if (opts.cacheDir.empty()) {
+        s = S(imIn, opts.threads, opts.sums);
+    } else {
+        imageKey key(imIn);
+        string file = opts.cacheDir + "/" + S::cacheName(key, opts.sums);
+        if (!s.readFromFile(file, key, opts.sums)) {
+            s = S(imIn, opts.threads, opts.sums);
+            s.writeToFile(file, key);
+        }
+    }
+    cost.prepare(s, imIn, opts.threads);
+    if (opts.tol > 0) {
+        s.buildMoments(imIn, opts.threads); // for withinTol
+    }
+    pair<int, int> ul(0, 0);
+    pair<int, int> lr(imIn.width() - 1, imIn.height() - 1);
+    // a full tree has one leaf per pixel, and one fewer split nodes
+    long size = max(2L * width * height - 1, 0L);
+    if (opts.maxLeaves > 0) {
+        size = min(size, 2L * (long)opts.maxLeaves - 1);
+    }
+    if (resolveThreads(opts.threads) == 1 || opts.audit != NULL ||
+        opts.maxLeaves > 0) {
+        buildArena arena;
+        arena.nodes.reserve(size);
+        arena.profile.resize(max(width, height));
+        if (opts.maxLeaves > 0) {
+            root = buildBest(s, cost, ul, lr, opts, arena);
+        } else {
+            root = buildTree(s, cost, ul, lr, true, opts, arena);
+        }
+        compact(arena.nodes);
+        return root;
+    }
+
+    subtree top;
+    {
+        threadPool pool(opts.threads);
+        taskGroup group(pool);
+        buildTask(s, cost, ul, lr, true, opts, group, top);
+        group.wait();
+    }
+    vector<Node> spliced;
+    spliced.reserve(size);
+    root = splice(top, spliced);
+    compact(spliced);
+    return root;
+}
+
+template <class S, class Cost>
+void twoDtree::buildTask(S &s, const Cost &cost, pair<int, int> ul,
+                         pair<int, int> lr, bool vert,
+                         const buildOptions &opts, taskGroup &group,
+                         subtree &out) {
+    // LT goes to a task of its own and this task goes on with RB, so a
+    // deep tree takes a loop rather than a stack frame per level
+    // below the grain, or a single pixel: built by buildTree
+    long grain = max(opts.grain, 2L);
+    buildArena split;
+    split.pool = &group.pool();
+    subtree *at = &out;
+    while (true) {
+        int x0 = ul.first, y0 = ul.second;
+        int x1 = lr.first, y1 = lr.second;
+        if (x0 > x1 || y0 > y1) {
+            return; // no subtree, as in buildTree
+        }
+        long area = (long)(x1 - x0 + 1) * (y1 - y0 + 1);
+        if (area < grain) {
+            at->arena.nodes.reserve(2 * area - 1);
+            at->arena.profile.resize(max(x1 - x0 + 1, y1 - y0 + 1));
+            buildTree(s, cost, ul, lr, vert, opts, at->arena);
+            vector<double>().swap(at->arena.profile);
+            return;
+        }
+
+        // the rectangles only shrink, so the first size fits them all
+        if (split.profile.empty()) {
+            split.profile.resize(max(x1 - x0 + 1, y1 - y0 + 1));
+        }
+        at->node = Node(s.getAvg(ul, lr));
+        if (opts.tol > 0 && withinTol(s, ul, lr, at->node.avg, opts.tol)) {
+            // a leaf, as buildTree leaves it
+            at->arena.nodes.push_back(at->node);
+            return;
+        }
+        splitNode(s, cost, ul, lr, vert, opts, split, at->node);
+        pair<int, int> ltlr, rbul;
+        splitRect(at->node.vert, at->node.split, ul, lr, ltlr, rbul);
+        at->LT.reset(new subtree());
+        at->RB.reset(new subtree());
+        subtree *lt = at->LT.get();
+        subtree *rb = at->RB.get();
+        bool next = !at->node.vert;
+        vert = next;
+        // a child below the grain is not worth a task: it is built at
+        // once, by buildTree, and the loop goes on with the other one
+        if (s.rectArea(ul, ltlr) < grain) {
+            buildTask(s, cost, ul, ltlr, next, opts, group, *lt);
+        } else if (s.rectArea(rbul, lr) < grain) {
+            buildTask(s, cost, rbul, lr, next, opts, group, *rb);
+            lr = ltlr;
+            at = lt;
+            continue;
+        } else {
+            group.run([this, &s, &cost, ul, ltlr, next, &opts, &group,
+                       lt]() {
+                buildTask(s, cost, ul, ltlr, next, opts, group, *lt);
+            });
+        }
+        ul = rbul;
+        at = rb;
+    }
+}
+
+twoDtree::subtree::~subtree() {
+    // children are detached before they are freed, so freeing a deep
+    // tree does not recurse
+    if (!LT && !RB) {
+        return;
+    }
+    vector<unique_ptr<subtree>> pending;
+    pending.push_back(std::move(LT));
+    pending.push_back(std::move(RB));
+    while (!pending.empty()) {
+        unique_ptr<subtree> t = std::move(pending.back());
+        pending.pop_back();
+        if (t) {
+            pending.push_back(std::move(t->LT));
+            pending.push_back(std::move(t->RB));
+        }
+    }
+}
+
+uint32_t twoDtree::splice(subtree &top, vector<Node> &out) {
+    // each subtree still to append, with the node whose LT or RB index
+    // is its root (NONE for the root of the whole tree)
+    struct pendingSubtree {
+        subtree *t;
+        uint32_t parent;
+        bool rb;
+    };
+    uint32_t first = NONE;
+    vector<pendingSubtree> pending(1, pendingSubtree{&top, NONE, false});
+    while (!pending.empty()) {
+        pendingSubtree p = pending.back();
+        pending.pop_back();
+        subtree &t = *p.t;
+        uint32_t at = NONE;
+        if (t.LT) {
+            at = out.size();
+            out.push_back(t.node);
+            pending.push_back(pendingSubtree{t.RB.get(), at, true});
+            pending.push_back(pendingSubtree{t.LT.get(), at, false});
+        } else if (!t.arena.nodes.empty()) {
+            at = out.size();
+            for (size_t i = 0; i < t.arena.nodes.size(); i++) {
+                Node node = t.arena.nodes[i];
+                node.LT = (node.LT == NONE) ? NONE : node.LT + at;
+                node.RB = (node.RB == NONE) ? NONE : node.RB + at;
+                out.push_back(node);
+            }
+            vector<Node>().swap(t.arena.nodes);
+        }
+        if (p.parent == NONE) {
+            first = at;
+        } else if (p.rb) {
+            out[p.parent].RB = at;
+        } else {
+            out[p.parent].LT = at;
+        }
+    }
+    return first;
 }
 
 twoDtree &twoDtree::operator=(const twoDtree &rhs) {
@@ -37,154 +253,678 @@ twoDtree &twoDtree::operator=(const twoDtree &rhs) {
     return *this;
 }
 
+twoDtree &twoDtree::operator=(twoDtree &&rhs) noexcept {
+    if (this != &rhs) {
+        shared = std::move(rhs.shared);
+        collapse = std::move(rhs.collapse);
+        root = rhs.root;
+        height = rhs.height;
+        width = rhs.width;
+        rhs.root = NONE;
+        rhs.height = 0;
+        rhs.width = 0;
+    }
+    return *this;
+}
+
 PNG twoDtree::render() {
     PNG img(width, height);
-    render(root, img);
+    render(img);
+    return img;
+}
+
+void twoDtree::render(PNG &out) {
+    if ((int)out.width() != width || (int)out.height() != height) {
+        out = PNG(width, height);
+    }
+    // the leaves cover every pixel, so nothing of out shows through
+    render(root, pair<int, int>(0, 0), pair<int, int>(width - 1, height - 1),
+           out);
+}
+
+PNG twoDtree::render(double tol) {
+    annotate();
+    PNG img(width, height);
+    render(root, pair<int, int>(0, 0), pair<int, int>(width - 1, height - 1),
+           img, tol);
     return img;
 }
 
-void twoDtree::render(Node *root, PNG &img) {
-    if (root != NULL) {
-        if (root->LT == NULL && root->RB == NULL) {
-            // leaf, upLeft == lowRight
-            int x0 = root->upLeft.first, y0 = root->upLeft.second;
-            int x1 = root->lowRight.first, y1 = root->lowRight.second;
-            for (int x = x0; x <= x1; x++) {
-                for (int y = y0; y <= y1; y++) {
-                    img.getPixel(x, y)->h = root->avg.h;
-                    img.getPixel(x, y)->s = root->avg.s;
-                    img.getPixel(x, y)->l = root->avg.l;
-                    img.getPixel(x, y)->a = root->avg.a;
+size_t twoDtree::leafCount(double tol) {
+    annotate();
+    const vector<Node> &nodes = arenaNodes();
+    const vector<double> &limits = *collapse;
+    size_t leaves = 0;
+    vector<uint32_t> pending;
+    if (root != NONE) {
+        pending.push_back(root);
+    }
+    while (!pending.empty()) {
+        uint32_t i = pending.back();
+        pending.pop_back();
+        const Node &node = nodes[i];
+        if ((node.LT == NONE && node.RB == NONE) || limits[i] < tol) {
+            leaves++;
+        } else {
+            pending.push_back(node.RB);
+            pending.push_back(node.LT);
+        }
+    }
+    return leaves;
+}
+
+void twoDtree::render(uint32_t root, pair<int, int> ul, pair<int, int> lr,
+                      PNG &img, double tol) {
+    const vector<Node> &nodes = arenaNodes();
+    vector<nodeRect> &pending = renderStack;
+    pending.clear();
+    if (root != NONE) {
+        pending.push_back(nodeRect(root, ul, lr, false));
+    }
+    while (!pending.empty()) {
+        nodeRect r = pending.back();
+        pending.pop_back();
+        const Node &node = nodes[r.node];
+        if ((node.LT == NONE && node.RB == NONE) ||
+            (tol > 0 && (*collapse)[r.node] < tol)) {
+            // leaf, upLeft == lowRight, or a node pruned at tol
+            for (int x = r.ul.first; x <= r.lr.first; x++) {
+                for (int y = r.ul.second; y <= r.lr.second; y++) {
+                    img.getPixel(x, y)->h = node.avg.h;
+                    img.getPixel(x, y)->s = node.avg.s;
+                    img.getPixel(x, y)->l = node.avg.l;
+                    img.getPixel(x, y)->a = node.avg.a;
                 }
             }
         } else {
             // not leaf, upLeft != lowRight
-            render(root->LT, img);
-            render(root->RB, img);
+            pair<int, int> ltlr, rbul;
+            splitRect(node.vert, node.split, r.ul, r.lr, ltlr, rbul);
+            pending.push_back(nodeRect(node.RB, rbul, r.lr, false));
+            pending.push_back(nodeRect(node.LT, r.ul, ltlr, false));
+        }
+    }
+}
+
+packedTree twoDtree::pack() const {
+    packedTree out;
+    out.width = width;
+    out.height = height;
+    const vector<Node> &nodes = arenaNodes();
+    out.nodes.reserve(nodes.size());
+    // packed trees are in preorder: LT's subtree before RB
+    vector<uint32_t> pending;
+    if (root != NONE) {
+        pending.push_back(root);
+    }
+    while (!pending.empty()) {
+        const Node &node = nodes[pending.back()];
+        pending.pop_back();
+        if (node.LT == NONE && node.RB == NONE) {
+            out.add(node.avg, packedTree::LEAF);
+        } else {
+            out.add(node.avg, (node.vert ? packedTree::VERT : 0) | node.split);
+            pending.push_back(node.RB);
+            pending.push_back(node.LT);
         }
     }
+    return out;
 }
 
+
 /**
  * prune function modifies tree by cutting off
  * subtrees whose leaves are all within tol of
  * the average pixel value contained in the root
  * of the subtree
  */
-// FIXME: not working
 void twoDtree::prune(double tol) {
-    prune(root, tol);
+    vector<coneBox> boxes;
+    if (!collapse) {
+        coneBoxes(boxes);
+    }
+    vector<bool> cut(arenaNodes().size(), false);
+    prune(root, tol, boxes, cut);
+    compact(arenaNodes(), cut);
 }
 
-void twoDtree::prune(Node *root, double tol) {
-    if (root != NULL) {
-        if (toPrune(root->LT, root->avg, tol)) {
-            clear(root->LT);
-        } else {
-            prune(root->LT, tol);
+void twoDtree::prune(uint32_t root, double tol,
+                     const vector<coneBox> &boxes, vector<bool> &cut) {
+    const vector<Node> &nodes = arenaNodes();
+    vector<uint32_t> pending, scratch;
+    if (root != NONE) {
+        pending.push_back(root);
+    }
+    while (!pending.empty()) {
+        uint32_t i = pending.back();
+        const Node &node = nodes[i];
+        pending.pop_back();
+        if (node.LT == NONE && node.RB == NONE) {
+            continue;
         }
-        if (toPrune(root->RB, root->avg, tol)) {
-            clear(root->RB);
+        uint32_t lt = node.LT, rb = node.RB;
+        // collapse holds the farthest leaf's dist, the same value toPrune
+        // compares for that leaf
+        bool within = collapse ? (*collapse)[i] < tol
+                               : toPrune(lt, node.avg, tol, boxes, scratch) &&
+                                     toPrune(rb, node.avg, tol, boxes, scratch);
+        if (within) {
+            cut[i] = true;
         } else {
-            prune(root->RB, tol);
+            pending.push_back(rb);
+            pending.push_back(lt);
         }
     }
 }
 
-bool twoDtree::toPrune(Node *root, const HSLAPixel col, double tol) {
-    if (root == NULL) {
-        return false;
-    } else if (root->LT == NULL && root->RB == NULL) {
-        return col.dist(root->avg) < tol;
+bool twoDtree::toPrune(uint32_t root, const HSLAPixel col, double tol,
+                       const vector<coneBox> &boxes,
+                       vector<uint32_t> &pending) {
+    const vector<Node> &nodes = arenaNodes();
+    double c[3];
+    conePoint(col, c);
+    pending.clear();
+    pending.push_back(root);
+    while (!pending.empty()) {
+        uint32_t i = pending.back();
+        pending.pop_back();
+        if (i == NONE) {
+            continue;
+        }
+        // the squares of the farthest differences along each axis, as
+        // dist rounds them: a leaf's dist is at most their sum and at
+        // least the largest, since rounding keeps the order of values.
+        // For a leaf the sum is its dist.
+        const Node &node = nodes[i];
+        double far[3];
+        if (farCorner(c, boxes[i], far) < tol) {
+            continue;
+        } else if (node.LT == NONE && node.RB == NONE) {
+            return false;
+        } else if (!(max(far[0], max(far[1], far[2])) < tol)) {
+            return false;
+        }
+        pending.push_back(node.RB);
+        pending.push_back(node.LT);
     }
-    return toPrune(root->LT, col, tol) && toPrune(root->RB, col, tol);
+    return true;
 }
 
-void twoDtree::clear() {
-    clear(root);
-    root = NULL;
+void twoDtree::annotate() {
+    if (collapse) {
+        return;
+    }
+    const vector<Node> &nodes = arenaNodes();
+    vector<coneBox> boxes;
+    coneBoxes(boxes);
+    vector<double> limits(nodes.size(), 0.0);
+    vector<uint32_t> pending;
+    double far[3];
+    for (size_t i = 0; i < nodes.size(); i++) {
+        if (nodes[i].LT == NONE && nodes[i].RB == NONE) {
+            continue;
+        }
+        double c[3];
+        conePoint(nodes[i].avg, c);
+        // a subtree holds a farther leaf only if its farthest corner is
+        // farther, and a leaf's corner sum is its dist
+        double farthest = 0.0;
+        pending.assign(1, (uint32_t)i);
+        while (!pending.empty()) {
+            uint32_t j = pending.back();
+            pending.pop_back();
+            const Node &node = nodes[j];
+            double bound = farCorner(c, boxes[j], far);
+            if (!(bound > farthest)) {
+                continue;
+            } else if (node.LT == NONE && node.RB == NONE) {
+                farthest = bound;
+                continue;
+            }
+            // the more promising child first, to raise farthest early
+            double lt = farCorner(c, boxes[node.LT], far);
+            double rb = farCorner(c, boxes[node.RB], far);
+            pending.push_back(lt < rb ? node.LT : node.RB);
+            pending.push_back(lt < rb ? node.RB : node.LT);
+        }
+        limits[i] = farthest;
+    }
+    collapse = make_shared<const vector<double>>(std::move(limits));
 }
 
-void twoDtree::clear(Node *subRoot) {
-    if (subRoot != NULL) {
-        clear(subRoot->LT);
-        clear(subRoot->RB);
-        subRoot = NULL;
-        delete subRoot;
+double twoDtree::farCorner(const double c[3], const coneBox &box,
+                           double far[3]) {
+    for (int k = 0; k < 3; k++) {
+        double lo = c[k] - box.lo[k];
+        double hi = c[k] - box.hi[k];
+        far[k] = max(lo * lo, hi * hi);
     }
+    return far[0] + far[1] + far[2];
+}
+
+void twoDtree::coneBoxes(vector<coneBox> &boxes) const {
+    const vector<Node> &nodes = arenaNodes();
+    boxes.resize(nodes.size());
+    for (size_t i = nodes.size(); i-- > 0;) {
+        const Node &node = nodes[i];
+        coneBox &box = boxes[i];
+        if (node.LT == NONE && node.RB == NONE) {
+            conePoint(node.avg, box.lo);
+            conePoint(node.avg, box.hi);
+            continue;
+        }
+        const coneBox &lt = boxes[node.LT];
+        const coneBox &rb = boxes[node.RB];
+        for (int k = 0; k < 3; k++) {
+            box.lo[k] = min(lt.lo[k], rb.lo[k]);
+            box.hi[k] = max(lt.hi[k], rb.hi[k]);
+        }
+    }
+}
+
+void twoDtree::conePoint(const HSLAPixel &c, double v[3]) {
+    // the terms of HSLAPixel::dist, in its order of operations
+    v[0] = sin(c.h * PI / 180.) * c.s * c.l;
+    v[1] = cos(c.h * PI / 180.) * c.s * c.l;
+    v[2] = c.l;
+}
+
+const vector<twoDtree::Node> &twoDtree::arenaNodes() const {
+    static const vector<Node> none;
+    return shared ? *shared : none;
+}
+
+void twoDtree::clear() {
+    shared.reset();
+    collapse.reset();
+    root = NONE;
 }
 
 void twoDtree::copy(const twoDtree &other) {
     width = other.width;
     height = other.height;
-    root = copy(other.root);
+    shared = other.shared;
+    collapse = other.collapse;
+    root = other.root;
 }
 
-twoDtree::Node *twoDtree::copy(const Node *other) {
-    if (other == NULL) {
-        return NULL;
+void twoDtree::compact(const vector<Node> &from, const vector<bool> &cut) {
+    // a node keeps its children unless it is a leaf or was cut
+    auto split = [&](uint32_t i) {
+        return (from[i].LT != NONE || from[i].RB != NONE) &&
+               (cut.empty() || !cut[i]);
+    };
+    vector<Node> kept;
+    if (root != NONE) {
+        // old indices of the reachable nodes, breadth first; a split
+        // node's children are the next pair appended
+        vector<uint32_t> order(1, root);
+        for (size_t i = 0; i < order.size(); i++) {
+            if (split(order[i])) {
+                order.push_back(from[order[i]].LT);
+                order.push_back(from[order[i]].RB);
+            }
+        }
+        kept.reserve(order.size());
+        uint32_t next = 1;
+        for (size_t i = 0; i < order.size(); i++) {
+            Node node = from[order[i]];
+            if (split(order[i])) {
+                node.LT = next;
+                node.RB = next + 1;
+                next += 2;
+            } else {
+                node.LT = NONE;
+                node.RB = NONE;
+            }
+            kept.push_back(node);
+        }
+        root = 0;
     }
-    Node *curr = new Node(other->upLeft, other->lowRight, other->avg);
-    curr->LT = copy(other->LT);
-    curr->RB = copy(other->RB);
-    return curr;
+    // from may be the arena being replaced, so it is read first
+    shared = make_shared<const vector<Node>>(std::move(kept));
+    collapse.reset();
 }
 
-twoDtree::Node *twoDtree::buildTree(stats &s, pair<int, int> ul,
-                                    pair<int, int> lr, bool vert) {
+
+template <class S, class Cost>
+uint32_t twoDtree::buildTree(S &s, const Cost &cost, pair<int, int> ul,
+                             pair<int, int> lr, bool vert,
+                             const buildOptions &opts, buildArena &arena) {
     int x0 = ul.first, y0 = ul.second;
     int x1 = lr.first, y1 = lr.second;
-    if (x0 < 0 || y0 < 0 || x1 >= width || y1 > height) {
-        // FIXME: should not be called
+    if (x0 < 0 || y0 < 0 || x1 >= width || y1 >= height) {
         // outside of image
-        return NULL;
+        return NONE;
     } else if (x0 > x1 || y0 > y1) {
-        // FIXME: should not be called
         // invalid rectangle
-        return NULL;
-    }
-
-    Node *curr = new Node(ul, lr, s.getAvg(ul, lr));
-
-    if ((x1 == x0) && (y1 == y0)) {
-        // no split (leaf node)
-        curr->LT = NULL;
-        curr->RB = NULL;
-    } else if ((y1 == y0) || vert) {
-        // vertical split
-        double minSumEntropy = numeric_limits<double>::max();
-        int xk = x0;
-        for (int xi = x0; xi < x1; xi++) {
-            pair<int, int> lul = ul;        // left, upper-left
-            pair<int, int> llr(xi, y1);     // left, lower-right
-            pair<int, int> rul(xi + 1, y0); // right, upper-left
-            pair<int, int> rlr = lr;        // right, lower-right
-            double sumEntropy = s.weightedSumEntropy(lul, llr, rul, rlr);
-            if (sumEntropy <= minSumEntropy) {
-                minSumEntropy = sumEntropy;
-                xk = xi;
+        return NONE;
+    }
+
+    // depth first, LT before RB, so the rectangles split one after the
+    // other are close together in the stats tables; the two children of
+    // a split are appended together. A node is only reached by index, as
+    // appending to the arena may move it.
+    vector<Node> &nodes = arena.nodes;
+    uint32_t top = nodes.size();
+    nodes.push_back(Node(s.getAvg(ul, lr)));
+    vector<nodeRect> pending(1, nodeRect(top, ul, lr, vert));
+    while (!pending.empty()) {
+        nodeRect r = pending.back();
+        pending.pop_back();
+        if (r.ul == r.lr) {
+            // no split (leaf node)
+            continue;
+        }
+        if (opts.tol > 0 &&
+            withinTol(s, r.ul, r.lr, nodes[r.node].avg, opts.tol)) {
+            // prune(tol) would cut the subtree off here
+            continue;
+        }
+        splitNode(s, cost, r.ul, r.lr, r.vert, opts, arena, nodes[r.node]);
+        bool split = nodes[r.node].vert;
+        pair<int, int> ltlr, rbul;
+        splitRect(split, nodes[r.node].split, r.ul, r.lr, ltlr, rbul);
+        uint32_t lt = nodes.size();
+        nodes.push_back(Node(s.getAvg(r.ul, ltlr)));
+        nodes.push_back(Node(s.getAvg(rbul, r.lr)));
+        nodes[r.node].LT = lt;
+        nodes[r.node].RB = lt + 1;
+        pending.push_back(nodeRect(lt + 1, rbul, r.lr, !split));
+        pending.push_back(nodeRect(lt, r.ul, ltlr, !split));
+    }
+
+    return top;
+}
+
+template <class S>
+bool twoDtree::withinTol(S &s, pair<int, int> ul, pair<int, int> lr,
+                         const HSLAPixel &avg, double tol) {
+    // the exact sum is within slack of distSum's; every pixel is at
+    // most its root from avg, some at least the root of it over the
+    // area, and every leaf within err of its pixel
+    double sum = s.distSum(ul, lr, avg);
+    double slack = s.distSumError(ul, lr, avg);
+    double err = s.leafError();
+    double far = sqrt(sum + slack) + err;
+    double near = sqrt(max(sum - slack, 0.0) / s.rectArea(ul, lr)) - err;
+    // far more than the rounding of dist itself, for the leaves
+    const double MARGIN = 1e-12;
+    if (far * far < tol - MARGIN) {
+        return true;
+    } else if (near > 0 && near * near >= tol + MARGIN) {
+        return false;
+    }
+    // too close to call: compare the leaves' colors, as toPrune does
+    for (int y = ul.second; y <= lr.second; y++) {
+        for (int x = ul.first; x <= lr.first; x++) {
+            pair<int, int> p(x, y);
+            if (!(avg.dist(s.getAvg(p, p)) < tol)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+namespace {
+// a rectangle of the best-first build that is not split yet
+struct frontierRect {
+    double gain;
+    uint32_t node;
+    pair<int, int> ul, lr;
+};
+
+// the frontier's top is its largest gain; of equal gains, the node made
+// first, so a budget large enough builds the whole tree
+struct smallerGain {
+    bool operator()(const frontierRect &a, const frontierRect &b) const {
+        return a.gain < b.gain || (a.gain == b.gain && a.node > b.node);
+    }
+};
+} // namespace
+
+template <class S, class Cost>
+uint32_t twoDtree::buildBest(S &s, const Cost &cost, pair<int, int> ul,
+                             pair<int, int> lr, const buildOptions &opts,
+                             buildArena &arena) {
+    if (ul.first > lr.first || ul.second > lr.second) {
+        return NONE; // empty image
+    }
+    vector<Node> &nodes = arena.nodes;
+    priority_queue<frontierRect, vector<frontierRect>, smallerGain> frontier;
+    // splits a new node's rectangle, and queues it unless it is a pixel
+    auto reach = [&](uint32_t i, pair<int, int> u, pair<int, int> l,
+                     bool vert) {
+        if (u == l || (opts.tol > 0 &&
+                       withinTol(s, u, l, nodes[i].avg, opts.tol))) {
+            return;
+        }
+        splitNode(s, cost, u, l, vert, opts, arena, nodes[i]);
+        const Node &node = nodes[i];
+        frontierRect r;
+        r.gain = cost.gain(s, u, l, cost(s, u, l, node.vert, node.split));
+        r.node = i;
+        r.ul = u;
+        r.lr = l;
+        frontier.push(r);
+    };
+
+    uint32_t top = nodes.size();
+    nodes.push_back(Node(s.getAvg(ul, lr)));
+    reach(top, ul, lr, true);
+    // every split turns one leaf into two
+    for (size_t leaves = 1; leaves < opts.maxLeaves && !frontier.empty();
+         leaves++) {
+        frontierRect r = frontier.top();
+        frontier.pop();
+        bool split = nodes[r.node].vert;
+        pair<int, int> ltlr, rbul;
+        splitRect(split, nodes[r.node].split, r.ul, r.lr, ltlr, rbul);
+        uint32_t lt = nodes.size();
+        nodes.push_back(Node(s.getAvg(r.ul, ltlr)));
+        nodes.push_back(Node(s.getAvg(rbul, r.lr)));
+        nodes[r.node].LT = lt;
+        nodes[r.node].RB = lt + 1;
+        reach(lt, r.ul, ltlr, !split);
+        reach(lt + 1, rbul, r.lr, !split);
+    }
+    return top;
+}
+
+template <class S, class Cost>
+void twoDtree::splitNode(S &s, const Cost &cost, pair<int, int> ul,
+                         pair<int, int> lr, bool vert,
+                         const buildOptions &opts, buildArena &arena,
+                         Node &node) {
+    // a single column has no vertical lines left, a single row no
+    // horizontal ones
+    node.vert = (lr.first > ul.first) && ((lr.second == ul.second) || vert);
+    node.split = findSplit(s, cost, ul, lr, node.vert, opts, arena);
+}
+
+template <class S, class Cost>
+int twoDtree::findSplit(S &s, const Cost &cost, pair<int, int> ul,
+                        pair<int, int> lr, bool vert,
+                        const buildOptions &opts, buildArena &arena) {
+    if (opts.search == SEARCH_COARSE) {
+        return coarseSplit(s, cost, ul, lr, vert, opts);
+    }
+    return scanSplit(s, cost, ul, lr, vert, &arena, opts.splitGrain);
+}
+
+template <class S>
+int twoDtree::findSplit(S &s, const entropyCost &cost, pair<int, int> ul,
+                        pair<int, int> lr, bool vert,
+                        const buildOptions &opts, buildArena &arena) {
+    if (opts.search == SEARCH_SWEEP || opts.search == SEARCH_BOUND) {
+        return sweepSplit(s, ul, lr, vert, opts, arena);
+    } else if (opts.search == SEARCH_COARSE) {
+        return coarseSplit(s, cost, ul, lr, vert, opts);
+    }
+    return scanSplit(s, cost, ul, lr, vert, &arena, opts.splitGrain);
+}
+
+template <class S, class Cost>
+int twoDtree::coarseSplit(S &s, const Cost &cost, pair<int, int> ul,
+                          pair<int, int> lr, bool vert,
+                          const buildOptions &opts) {
+    int lo = vert ? ul.first : ul.second;
+    int hi = vert ? lr.first : lr.second; // lines are lo .. hi-1
+    const int MAX_KEPT = 8;
+    int stride = max(1, opts.coarseStride);
+    int keep = min(max(1, opts.refineCount), MAX_KEPT);
+    int window = max(0, opts.refineWindow);
+    if ((hi - lo) / stride + 1 + keep * 2 * window >= hi - lo) {
+        return scanSplit(s, cost, ul, lr, vert); // no cheaper than a scan
+    }
+
+    // the best lines of the coarse pass, lowest cost first; ties go to
+    // the later line, as in the exhaustive searches
+    double keptCost[MAX_KEPT];
+    int keptLine[MAX_KEPT];
+    int kept = 0;
+    long evaluated = 0;
+    for (int i = lo;; i += stride) {
+        i = min(i, hi - 1); // always try the last line
+        double c = cost(s, ul, lr, vert, i);
+        evaluated++;
+        int k = kept;
+        while (k > 0 && c <= keptCost[k - 1]) {
+            if (k < keep) {
+                keptCost[k] = keptCost[k - 1];
+                keptLine[k] = keptLine[k - 1];
             }
+            k--;
+        }
+        if (k < keep) {
+            keptCost[k] = c;
+            keptLine[k] = i;
+            kept = min(kept + 1, keep);
+        }
+        if (i == hi - 1) {
+            break;
         }
-        curr->LT = buildTree(s, ul, pair<int, int>(xk, y1), false);
-        curr->RB = buildTree(s, pair<int, int>(xk + 1, y0), lr, false);
-    } else if ((x1 == x0) || !vert) {
-        // horizontal spilt
-        double minSumEntropy = numeric_limits<double>::max();
-        int yk = y0;
-        for (int yi = y0; yi < y1; yi++) {
-            pair<int, int> uul = ul;        // upper, upper-left
-            pair<int, int> ulr(x1, yi);     // upper, lower-right
-            pair<int, int> lul(x0, yi + 1); // lower, upper-left
-            pair<int, int> llr = lr;        // lower, lower-right
-            double sumEntropy = s.weightedSumEntropy(uul, ulr, lul, llr);
-            if (sumEntropy <= minSumEntropy) {
-                minSumEntropy = sumEntropy;
-                yk = yi;
+    }
+
+    // refine left to right, so overlapping windows are evaluated once
+    sort(keptLine, keptLine + kept);
+    double minCost = numeric_limits<double>::max();
+    int best = lo;
+    int done = lo - 1; // last line refined so far
+    for (int k = 0; k < kept; k++) {
+        int first = max(done + 1, keptLine[k] - window);
+        int last = min(hi - 1, keptLine[k] + window);
+        done = max(done, last);
+        for (int i = first; i <= last; i++) {
+            double c = cost(s, ul, lr, vert, i);
+            evaluated++;
+            if (c < minCost || (c == minCost && i > best)) {
+                minCost = c;
+                best = i;
             }
         }
-        curr->LT = buildTree(s, ul, pair<int, int>(x1, yk), true);
-        curr->RB = buildTree(s, pair<int, int>(x0, yk + 1), lr, true);
     }
 
-    return curr;
+    if (opts.audit != NULL) {
+        auditSplit(s, cost, ul, lr, vert, opts, best, evaluated);
+    }
+    return best;
+}
+
+template <class S, class Cost>
+void twoDtree::auditSplit(S &s, const Cost &cost, pair<int, int> ul,
+                          pair<int, int> lr, bool vert,
+                          const buildOptions &opts, int chosen,
+                          long evaluated) {
+    int exact = scanSplit(s, cost, ul, lr, vert);
+    searchAudit &audit = *opts.audit;
+    audit.searches++;
+    audit.evaluated += evaluated;
+    audit.exhaustive += vert ? lr.first - ul.first : lr.second - ul.second;
+    if (exact != chosen) {
+        audit.mismatches++;
+        audit.excess += cost(s, ul, lr, vert, chosen) -
+                        cost(s, ul, lr, vert, exact);
+    }
+}
+
+template <class S, class Cost>
+int twoDtree::scanSplit(S &s, const Cost &cost, pair<int, int> ul,
+                        pair<int, int> lr, bool vert, buildArena *arena,
+                        long splitGrain) {
+    int lo = vert ? ul.first : ul.second;
+    int hi = vert ? lr.first : lr.second;
+    if (arena != NULL && arena->pool != NULL &&
+        s.rectArea(ul, lr) >= splitGrain) {
+        double *profile = arena->profile.data();
+        forEachChunk(arena->pool, lo, hi, [&](long first, long last) {
+            for (long i = first; i < last; i++) {
+                profile[i - lo] = cost(s, ul, lr, vert, i);
+            }
+        });
+        return lastMinimum(profile, lo, hi);
+    }
+
+    double minCost = numeric_limits<double>::max();
+    int best = lo;
+    for (int i = lo; i < hi; i++) {
+        double c = cost(s, ul, lr, vert, i);
+        if (c <= minCost) {
+            minCost = c;
+            best = i;
+        }
+    }
+    return best;
+}
+
+int twoDtree::lastMinimum(const double *profile, int lo, int hi) {
+    double minCost = HUGE_VAL;
+    int best = lo;
+    for (int i = lo; i < hi; i++) {
+        if (profile[i - lo] <= minCost) {
+            minCost = profile[i - lo];
+            best = i;
+        }
+    }
+    return best;
+}
+
+template <class S>
+int twoDtree::sweepSplit(S &s, pair<int, int> ul, pair<int, int> lr,
+                         bool vert, const buildOptions &opts,
+                         buildArena &arena) {
+    int lo = vert ? ul.first : ul.second;
+    int hi = vert ? lr.first : lr.second;
+    double bound = HUGE_VAL;
+    long evaluated = 0;
+    if (opts.search == SEARCH_BOUND && hi > lo) {
+        if (s.entropy(ul, lr) == 0.0) {
+            if (opts.audit != NULL) {
+                auditSplit(s, entropyCost(), ul, lr, vert, opts, hi - 1, 0);
+            }
+            return hi - 1;
+        }
+        // start from the middle line, so the profile can skip lines
+        // before it finds a good one
+        bound = entropyCost()(s, ul, lr, vert, lo + (hi - lo - 1) / 2);
+        evaluated++;
+    }
+    double *profile = arena.profile.data();
+    if (arena.pool != NULL && s.rectArea(ul, lr) >= opts.splitGrain) {
+        // chunks skip less than one sweep would, as each starts from
+        // bound alone, but they skip only lines that cannot win
+        forEachChunk(arena.pool, lo, hi, [&](long first, long last) {
+            s.splitProfile(ul, lr, vert, profile, bound, first, last);
+        });
+    } else {
+        evaluated += s.splitProfile(ul, lr, vert, profile, bound);
+    }
+
+    // skipped lines hold HUGE_VAL, above the lowest evaluated one
+    int best = lastMinimum(profile, lo, hi);
+    if (opts.search == SEARCH_BOUND && opts.audit != NULL) {
+        auditSplit(s, entropyCost(), ul, lr, vert, opts, best, evaluated);
+    }
+    return best;
 }
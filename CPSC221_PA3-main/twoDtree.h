@@ -10,14 +10,107 @@
 
 #include "cs221util/HSLAPixel.h"
 #include "cs221util/PNG.h"
+#include "packedTree.h"
+#include "splitCost.h"
 #include "stats.h"
+#include "threadPool.h"
 
+#include <cstdint>
 #include <limits>
+#include <memory>
 #include <utility>
+#include <vector>
 
 using namespace std;
 using namespace cs221util;
 
+/**
+ * How buildTree searches for the best split line of a rectangle. The
+ * scan and the sweep choose exactly the same split; the coarse search
+ * may settle for a slightly worse one.
+ */
+enum splitSearch {
+    SEARCH_SCAN,  // stats::weightedSumEntropy at every candidate line
+    SEARCH_SWEEP, // left/right histograms updated one strip at a time
+    SEARCH_COARSE, // every coarseStride-th line, then around the best ones
+    SEARCH_BOUND   // the sweep, skipping lines that cannot beat the best
+};
+
+/**
+ * Counters filled in by a build with buildOptions::audit set. Every
+ * coarse or bounded search is then checked against an exhaustive one,
+ * which makes the build much slower; use it to tune the searches, not in
+ * production. The bounded search never differs; the lines it skips are
+ * exhaustive - evaluated.
+ */
+struct searchAudit {
+    searchAudit()
+        : searches(0), mismatches(0), evaluated(0), exhaustive(0),
+          excess(0.0) {}
+
+    long searches;   // coarse or bounded searches made
+    long mismatches; // ... that chose another line than the exhaustive one
+    long evaluated;  // cost evaluations of those searches
+    long exhaustive; // ... and of exhaustive searches of the same lines
+    double excess;   // total cost above the exhaustive minima
+};
+
+/**
+ * Number of hue bins in the histograms that score a split; see
+ * binnedStats. The spec uses 36.
+ */
+enum histBins { BINS_16 = 16, BINS_36 = 36, BINS_72 = 72 };
+
+/**
+ * Options for building a twoDtree. The defaults build the tree described
+ * in the spec.
+ */
+struct buildOptions {
+    buildOptions()
+        : search(SEARCH_BOUND), threads(0), sums(SAT_DOUBLE), bins(BINS_36),
+          coarseStride(8), refineWindow(8), refineCount(3), audit(NULL),
+          grain(1L << 14), splitGrain(1L << 16), maxLeaves(0), tol(0.0) {}
+
+    splitSearch search;
+    int threads;   // for the stats and the tree; 0 uses every hardware thread
+    satMode sums;  // accumulation of the color sums, see stats
+    histBins bins; // hue bins of the split entropy
+
+    // if set, a directory in which the stats tables are cached by image
+    // (see binnedStats::cacheName), and reopened instead of rebuilt
+    string cacheDir;
+
+    // SEARCH_COARSE: the gap between the lines of the first pass, how many
+    // of its best lines are refined, and how many lines on either side
+    // of each of them the refinement looks at. A rectangle is searched
+    // exhaustively instead whenever the coarse pass plus the refinement
+    // would evaluate as many lines as a full scan.
+    int coarseStride;
+    int refineWindow;
+    int refineCount;
+    searchAudit *audit; // if set, checks every coarse or bounded search
+
+    // parallel builds: rectangles of fewer pixels are built by one task,
+    // and the lines of rectangles of at least splitGrain pixels are
+    // scored by several. The tree depends on neither, nor on the number
+    // of threads.
+    long grain;
+    long splitGrain;
+
+    // if not 0, build best first: of the rectangles not split yet, always
+    // split the one whose split gains most (see splitCost.h), until the
+    // tree has maxLeaves leaves. Nodes below those are never built. The
+    // splits made are those of the full tree. Always serial.
+    size_t maxLeaves;
+
+    // if positive, build the tree already pruned at tol: a rectangle is
+    // left a leaf once prune(tol) would cut its subtree off, so the tree
+    // is that of building it and calling prune(tol), without building
+    // the subtrees the prune removes. With maxLeaves, such rectangles
+    // are never split either.
+    double tol;
+};
+
 /**
  * twoDtree: This is a structure used in decomposing an image
  * into rectangles of similarly colored pixels.
@@ -32,16 +125,20 @@ private:
      */
     class Node {
     public:
-        Node(pair<int, int> ul, pair<int, int> lr,
-             HSLAPixel a); // Node constructor
+        Node(HSLAPixel a); // Node constructor
 
-        pair<int, int> upLeft;
-        pair<int, int> lowRight;
         HSLAPixel avg;
-        Node *LT; // left or top child rectangle
-        Node *RB; // right or bottom child rectangle
+        uint32_t LT; // index of the left or top child rectangle
+        uint32_t RB; // index of the right or bottom child rectangle
+        // the children split the rectangle after this column (vert) or
+        // row; rectangles are recomputed from the root's while walking
+        int split;
+        bool vert;
     };
 
+    // child index of a leaf, and root of an empty tree
+    static constexpr uint32_t NONE = 0xffffffff;
+
 public:
     /**
      * twoDtree destructor.
@@ -58,6 +155,14 @@ public:
      */
     twoDtree(const twoDtree &other);
 
+    /**
+     * Move constructor for a twoDtree. Takes over the nodes of other,
+     * which is left an empty tree, of a 0x0 image.
+     *
+     * @param other the twoDtree we are moving from.
+     */
+    twoDtree(twoDtree &&other) noexcept;
+
     /**
      * Constructor that builds a twoDtree out of the given PNG.
      * Every leaf in the tree corresponds to a pixel in the PNG.
@@ -92,6 +197,30 @@ public:
      */
     twoDtree(PNG &imIn);
 
+    /**
+     * Builds the same twoDtree as above, using the given build options.
+     *
+     * @param imIn the image to be constructed into a twoDtree.
+     * @param opts options controlling how the tree is built.
+     */
+    twoDtree(PNG &imIn, const buildOptions &opts);
+
+    /**
+     * Builds a twoDtree as above, but chooses every split line by the
+     * given cost policy instead of the entropy, e.g.
+     *
+     *   twoDtree t(im, buildOptions(), varianceCost());
+     *
+     * See splitCost.h for the policies; entropyCost gives the tree of
+     * the spec.
+     *
+     * @param imIn the image to be constructed into a twoDtree.
+     * @param opts options controlling how the tree is built.
+     * @param cost the split cost policy.
+     */
+    template <class Cost>
+    twoDtree(PNG &imIn, const buildOptions &opts, const Cost &cost);
+
     /**
      * Overloaded assignment operator for twoDtrees.
      *
@@ -99,6 +228,13 @@ public:
      */
     twoDtree &operator=(const twoDtree &rhs);
 
+    /**
+     * Move assignment operator for twoDtrees; rhs is left an empty tree.
+     *
+     * @param rhs the right hand side of the assignment statement.
+     */
+    twoDtree &operator=(twoDtree &&rhs) noexcept;
+
     /**
      * Render returns a PNG image consisting of the pixels
      * stored in the tree. may be used on pruned trees. Draws
@@ -107,91 +243,403 @@ public:
      */
     PNG render();
 
+    /**
+     * Renders the tree into out, as render() does. out keeps its pixels
+     * if it is already the size of the tree's image, and is replaced by
+     * one of that size otherwise, so rendering into the same image
+     * again allocates nothing.
+     *
+     * @param out image the tree is rendered on.
+     */
+    void render(PNG &out);
+
+    /**
+     * Returns the image prune(tol) followed by render() would give,
+     * without changing the tree. The first call works out, for every
+     * node, the tolerance above which prune makes it a leaf (see
+     * collapse); any tolerance is then rendered in one walk of the
+     * nodes it draws.
+     *
+     * @param tol tolerance factor of pruning.
+     */
+    PNG render(double tol);
+
+    /**
+     * Returns the number of leaves the tree would have after prune(tol),
+     * without changing it; see render(double).
+     *
+     * @param tol tolerance factor of pruning.
+     */
+    size_t leafCount(double tol);
+
     /**
      * Prune function trims subtrees as high as possible in the tree.
      * A subtree is pruned (cleared) if all of the subtree's leaves are within
      * tol of the average color stored in the root of the subtree.
      * Pruning criteria should be evaluated on the original tree, not
      * on any pruned subtree. (we only expect that trees would be pruned once.)
+     *
+     * Once render(double) or leafCount has filled collapse, each node is
+     * decided by its farthest leaf there, and the prune takes one walk of
+     * the tree. Otherwise toPrune decides it, from the color bounds of the
+     * subtrees where they suffice; subtrees they leave open are walked,
+     * so colors that keep many bounds open can still cost a walk per
+     * level.
      */
     void prune(double tol);
 
+    /**
+     * Returns a read-only copy of the tree in 8 bytes per node, for
+     * keeping large trees in memory; see packedTree.
+     */
+    packedTree pack() const;
+
 private:
-    Node *root; // ptr to the root of the twoDtree
+    // every node of the tree, so the tree is freed as a whole; children
+    // are indices into it. Nodes are laid out breadth first, so siblings
+    // are adjacent and each level is one contiguous run. The arena is
+    // never changed once built, so copies share it; a prune lays out
+    // the nodes it keeps in an arena of its own (see compact).
+    shared_ptr<const vector<Node>> shared;
+    uint32_t root; // index of the root of the twoDtree
+
+    // per node, the largest dist from its average to a leaf below it:
+    // prune(tol) makes the node a leaf for any tol above it. Null until
+    // render(double) or leafCount need it, and whenever the arena is
+    // replaced; shared by copies like the arena.
+    shared_ptr<const vector<double>> collapse;
 
     int height; // height of PNG represented by the tree
     int width;  // width of PNG represented by the tree
 
+    /**
+     * What one thread of a build writes to: the nodes it builds, and
+     * the split profile of the rectangle it is splitting. In a parallel
+     * build, pool scores the lines of large rectangles.
+     */
+    struct buildArena {
+        buildArena() : pool(NULL) {}
+
+        vector<Node> nodes;
+        vector<double> profile;
+        threadPool *pool;
+    };
+
+    /**
+     * A node together with its rectangle and the direction of its
+     * split, as queued by the iterative build and traversals.
+     */
+    struct nodeRect {
+        nodeRect(uint32_t n, pair<int, int> u, pair<int, int> l, bool v)
+            : node(n), ul(u), lr(l), vert(v) {}
+
+        uint32_t node;
+        pair<int, int> ul;
+        pair<int, int> lr;
+        bool vert;
+    };
+
+    // the stack of the render walk, kept so that rendering again does
+    // not allocate; not part of the tree's value
+    vector<nodeRect> renderStack;
+
+    /**
+     * The bounding box of the colors of a subtree's leaves, in the color
+     * cone HSLAPixel::dist measures in; see conePoint.
+     */
+    struct coneBox {
+        double lo[3];
+        double hi[3];
+    };
+
+    /**
+     * A subtree built by the tasks of a parallel build: either a node
+     * whose children are subtrees of their own, or a subtree built by
+     * one task, in its own arena (empty for no subtree). Freed with an
+     * explicit stack, however deep.
+     */
+    struct subtree {
+        subtree() : node(HSLAPixel()) {}
+        ~subtree();
+
+        Node node;
+        unique_ptr<subtree> LT, RB;
+        buildArena arena;
+    };
+
     /**
      * Destroys all dynamically allocated memory associated with the
-     * current twoDtree class. Complete for PA3.
-     * You may want a recursive helper function for this one.
+     * current twoDtree class, by freeing the node arena.
      */
     void clear();
 
     /**
-     * Destroys all dynamically allocated memory in the descendants of subRoot.
-     * Private helper function for the clear function.
-     *
-     * @param subRoot the root of the twoDtree to be deleted.
+     * Returns the node arena, or an empty one for a tree moved from.
      */
-    void clear(Node *subRoot);
+    const vector<Node> &arenaNodes() const;
 
     /**
      * Copies the parameter other twoDtree into the current twoDtree.
      * Does not free any memory. Called by copy constructor and op=.
+     * The arena is shared with other rather than copied, so this takes
+     * the same time for any tree.
      *
      * @param other the twoDtree to be copied.
      */
     void copy(const twoDtree &other);
 
     /**
-     * Returns the root ptr of the copied twoDtree. Prvate helper function for
-     * the copy function.
+     * Copies the nodes of from reachable from root into a new arena,
+     * breadth first, and makes it the tree's; the old arena is freed
+     * unless a copy still shares it. Lays out a newly built tree, and
+     * drops the nodes below those marked in cut (empty for none).
+     */
+    void compact(const vector<Node> &from,
+                 const vector<bool> &cut = vector<bool>());
+
+    /**
+     * Builds the tables of type S (a binnedStats) for imIn, or reads them
+     * from opts.cacheDir, and returns the index of the root of the tree
+     * built from them. Private helper function for the constructor.
+     */
+    template <class S, class Cost>
+    uint32_t buildWith(PNG &imIn, const buildOptions &opts, const Cost &cost);
+
+    /**
+     * Builds the twoDtree according to the specification of the
+     * constructor, appending its nodes to the arena. The rectangles still
+     * to split wait on an explicit stack, so the build needs no
+     * recursion; a split's two children are appended together, and
+     * compact lays the finished tree out breadth first. Returns the
+     * index of the subtree's root in arena.nodes. Private helper function
+     * for the constructor.
      *
-     * @param other the root of the twoDtree to be copied.
+     * @param s contains the data used to split the rectangles.
+     * @param cost the split cost policy.
+     * @param ul upper left point of current node's rectangle.
+     * @param lr lower right point of current node's rectangle.
+     * @param vert indicates if the split should be vertical or not.
+     * @param opts options controlling the split search.
+     * @param arena the arena to build in; its profile must hold a value
+     * per line of the rectangle, and its pool must be NULL. If
+     * opts.tol is positive, s needs its moment table.
+     */
+    template <class S, class Cost>
+    uint32_t buildTree(S &s, const Cost &cost, pair<int, int> ul,
+                       pair<int, int> lr, bool vert, const buildOptions &opts,
+                       buildArena &arena);
+
+    /**
+     * Returns true if every pixel of the rectangle ul, lr is within tol
+     * of avg, exactly as toPrune would find for its leaves. The
+     * distances to avg sum to at least the largest and at most area
+     * times it (stats::distSum), which decides most rectangles at once,
+     * allowing for the rounding of the sum (stats::distSumError) and for
+     * the leaves lying up to stats::leafError from their pixels; the
+     * rest are checked pixel by pixel. Private helper function for
+     * buildTree.
+     */
+    template <class S>
+    bool withinTol(S &s, pair<int, int> ul, pair<int, int> lr,
+                   const HSLAPixel &avg, double tol);
+
+    /**
+     * Builds the top of the twoDtree of ul, lr with at most
+     * opts.maxLeaves leaves, best first, into the arena, and returns the
+     * index of its root. Every rectangle is split when it is reached, to
+     * know its gain; a rectangle whose node stays a leaf keeps its split
+     * but no children. Private helper function for the constructor.
+     *
+     * @param arena the arena to build in; its profile must hold a value
+     * per line of the rectangle, and its pool must be NULL.
+     */
+    template <class S, class Cost>
+    uint32_t buildBest(S &s, const Cost &cost, pair<int, int> ul,
+                       pair<int, int> lr, const buildOptions &opts,
+                       buildArena &arena);
+
+    /**
+     * Sets the split axis and line of node, for the rectangle ul, lr of
+     * more than one pixel. Private helper function for buildTree.
+     */
+    template <class S, class Cost>
+    void splitNode(S &s, const Cost &cost, pair<int, int> ul,
+                   pair<int, int> lr, bool vert, const buildOptions &opts,
+                   buildArena &arena, Node &node);
+
+    /**
+     * Builds the subtree of ul, lr into out as buildTree does, but
+     * leaves rectangles of at least opts.grain pixels to a task each
+     * on the group's pool. A task splits its rectangle and goes on with
+     * one child in a loop: a child below the grain is built at once by
+     * buildTree, and if both are large LT is queued as a task of its
+     * own. Private helper function for the constructor.
      */
-    Node *copy(const Node *other);
+    template <class S, class Cost>
+    void buildTask(S &s, const Cost &cost, pair<int, int> ul,
+                   pair<int, int> lr, bool vert, const buildOptions &opts,
+                   taskGroup &group, subtree &out);
 
     /**
-     * Recursively builds the twoDtree according to the specification of the
-     * constructor. Private helper function for the constructor.
+     * Appends the subtree top to out, and returns the index of its
+     * root, walking it with an explicit stack. The subtrees' own layouts
+     * are kept; compact then lays out the whole tree breadth first.
+     */
+    uint32_t splice(subtree &top, vector<Node> &out);
+
+    /**
+     * Returns the x (vert) or y coordinate of the last line of the LT child
+     * for the split of the rectangle ul, lr whose cost is smallest. Ties
+     * go to the last such line. Private helper function for buildTree.
      *
      * @param s contains the data used to split the rectangles.
+     * @param cost the split cost policy.
      * @param ul upper left point of current node's rectangle.
      * @param lr lower right point of current node's rectangle.
      * @param vert indicates if the split should be vertical or not.
+     * @param opts options controlling the split search.
+     * @param arena whose profile has room for a value per line of the
+     * rectangle.
+     */
+    template <class S, class Cost>
+    int findSplit(S &s, const Cost &cost, pair<int, int> ul,
+                  pair<int, int> lr, bool vert, const buildOptions &opts,
+                  buildArena &arena);
+
+    /**
+     * findSplit for the entropy cost, which can also be searched by a
+     * sweep (see buildOptions::search).
+     */
+    template <class S>
+    int findSplit(S &s, const entropyCost &cost, pair<int, int> ul,
+                  pair<int, int> lr, bool vert, const buildOptions &opts,
+                  buildArena &arena);
+
+    /**
+     * findSplit for SEARCH_COARSE: evaluates the cost every
+     * opts.coarseStride lines, then at every line near the
+     * opts.refineCount best of those.
+     */
+    template <class S, class Cost>
+    int coarseSplit(S &s, const Cost &cost, pair<int, int> ul,
+                    pair<int, int> lr, bool vert, const buildOptions &opts);
+
+    /**
+     * findSplit for SEARCH_SCAN: evaluates the cost at every line. Given
+     * an arena with a pool and a rectangle of at least opts.splitGrain
+     * pixels, the lines are scored in chunks on the pool, into the
+     * arena's profile.
      */
-    Node *buildTree(stats &s, pair<int, int> ul, pair<int, int> lr, bool vert);
+    template <class S, class Cost>
+    int scanSplit(S &s, const Cost &cost, pair<int, int> ul,
+                  pair<int, int> lr, bool vert, buildArena *arena = NULL,
+                  long splitGrain = 0);
+
+    /**
+     * Returns the last line i in lo..hi-1 whose profile[i - lo] is the
+     * smallest, the tie-breaking rule of every search.
+     */
+    static int lastMinimum(const double *profile, int lo, int hi);
+
+    /**
+     * findSplit for SEARCH_SWEEP and SEARCH_BOUND: the last minimum of
+     * the rectangle's stats::splitProfile. For SEARCH_BOUND the
+     * profile is bounded by the cost of the middle line, so it skips
+     * lines that cannot beat it; a uniform rectangle costs 0 everywhere,
+     * so it takes the last line. Large rectangles are profiled in
+     * chunks on the arena's pool, as scanSplit does.
+     */
+    template <class S>
+    int sweepSplit(S &s, pair<int, int> ul, pair<int, int> lr, bool vert,
+                   const buildOptions &opts, buildArena &arena);
+
+    /**
+     * Records a coarse or bounded search of the lines of ul..lr in
+     * opts.audit, checking its choice against an exhaustive scan.
+     */
+    template <class S, class Cost>
+    void auditSplit(S &s, const Cost &cost, pair<int, int> ul,
+                    pair<int, int> lr, bool vert, const buildOptions &opts,
+                    int chosen, long evaluated);
 
     /**
      * Draws every leaf node's rectangle, of the given node root, onto the given
-     * image img. Private helper function for the render function.
+     * image img, walking the subtree with an explicit stack. Private helper
+     * function for the render function.
      *
-     * @param root node of the twoDtree to be rendered.
+     * @param root index of the node of the twoDtree to be rendered.
+     * @param ul upper left point of the node's rectangle.
+     * @param lr lower right point of the node's rectangle.
      * @param img image on which the twoDtree is rendered.
+     * @param tol if positive, nodes prune(tol) would cut off are drawn
+     * as leaves; collapse must be filled.
      */
-    void render(Node *root, PNG &img);
+    void render(uint32_t root, pair<int, int> ul, pair<int, int> lr,
+                PNG &img, double tol = 0.0);
+
+    /**
+     * Fills collapse, unless it is filled already. For each node, a
+     * search of its subtree for the leaf farthest from its average,
+     * which skips the subtrees whose bounds (see coneBoxes) cannot hold
+     * a farther one. Private helper function for render(double) and
+     * leafCount.
+     */
+    void annotate();
+
+    /**
+     * Returns the sum of the squared differences from c to the farthest
+     * corner of box along each axis, as dist rounds them, and sets
+     * far to the three squares; see toPrune.
+     */
+    static double farCorner(const double c[3], const coneBox &box,
+                            double far[3]);
 
     /**
      * Prunes the twoDtree at the given node if all of the subtree's leaves
-     * are within tol of the average color stored in the root of the subtree.
-     * Private helper function for the prune function.
+     * are within tol of the average color stored in the root of the subtree,
+     * and otherwise prunes its children, walking the subtree with an
+     * explicit stack. The shared arena is left as it is: pruned nodes
+     * are marked in cut, for compact. Private helper function for the
+     * prune function.
      *
-     * @param root node of the twoDtree to be pruned.
+     * @param root index of the node of the twoDtree to be pruned.
      * @param tol tolerance factor of pruning.
+     * @param boxes the leaf color bounds of every node, see coneBoxes;
+     * not used, and may be empty, if collapse is filled.
+     * @param cut set for the nodes whose children are cut off.
      */
-    void prune(Node *root, double tol);
+    void prune(uint32_t root, double tol, const vector<coneBox> &boxes,
+               vector<bool> &cut);
 
     /**
-     * Returns true if the twoDtree should be pruned at the given node. Private
-     * helper function for the prune function.
+     * Returns true if every leaf below the given node is within tol of
+     * col. The bounds of a subtree usually decide at once: if its
+     * farthest corner is within tol so are all its leaves, and if a face
+     * is not, neither is the leaf on it. Only subtrees the bounds leave
+     * open are walked into, with an explicit stack. Private helper
+     * function for the prune function.
      *
-     * @param root node of the twoDtree to be pruned.
+     * @param root index of the node of the twoDtree to be pruned.
      * @param col average color to be compared with leaves.
      * @param tol tolerance factor of pruning.
+     * @param boxes the leaf color bounds of every node, see coneBoxes.
+     * @param pending scratch stack for the walk.
+     */
+    bool toPrune(uint32_t root, const HSLAPixel col, double tol,
+                 const vector<coneBox> &boxes, vector<uint32_t> &pending);
+
+    /**
+     * Sets boxes[i] to the bounds of the leaf colors below node i, for
+     * every node, in one pass from the last node to the first; children
+     * always come after their parent in the arena.
+     */
+    void coneBoxes(vector<coneBox> &boxes) const;
+
+    /**
+     * Sets v to the point of color c in the color cone, computed exactly
+     * as HSLAPixel::dist computes it.
      */
-    bool toPrune(Node *root, const HSLAPixel col, double tol);
+    static void conePoint(const HSLAPixel &c, double v[3]);
 };
 
 #endif